@@ -0,0 +1,386 @@
+#include "../Common/Log.h"
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#ifdef _WIN32
+#include <direct.h>
+#define getcwd _getcwd
+#define NULL_DEVICE "NUL"
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+//Parameter sweep over the simulation build. Every combination of the swept driver arguments is run
+//repeats times, repeat r with workload seed seed + r, each in a fresh directory. The driver writes its
+//metrics to a results file which are collected into <out>.csv (one row per run) and <out>.json (runs
+//plus per-configuration means). Given baseline=<earlier csv>, configurations whose throughput, search
+//latency, message count or invalid rate got worse by more than tolerance are reported and the sweep
+//exits with status 1.
+//
+//Arguments are name=value[,value...], e.g.
+//	gnutella-benchmark supers=5,10 topology=0,1 mode=0,1,2,3,4,5 repeats=3 baseline=last.csv
+//	gnutella-benchmark "workload=popularity=zipf:0.8 size=lognormal:256K:1.5,popularity=uniform"
+//	gnutella-benchmark search=flood,ring topology=1
+
+#define DEFAULT_TOLERANCE 0.1
+#define DEFAULT_RUN_TIMEOUT_S 600
+
+//Driver arguments in the order it takes them, with their defaults. The seed and results file go
+//between ttl and degree. The last few are not arguments but environment variables every node reads
+const std::map<std::string, std::string> environmentParameters = {
+	{ "workload", "GNUTELLA_WORKLOAD" }, //See Workload.h
+	{ "search", "GNUTELLA_SEARCH" }, //flood or ring, see Leaf.cpp
+	{ "downloadWorkers", "GNUTELLA_DOWNLOAD_WORKERS" } //Concurrent downloads per leaf
+};
+const std::vector<std::pair<std::string, std::string>> driverParameters = {
+	{ "supers", "5" },
+	{ "leavesPerSuper", "3" },
+	{ "filesPerLeaf", "20" },
+	{ "requestsPerLeaf", "10" },
+	{ "topology", "0,1" },
+	{ "duplicationFactor", "2" },
+	{ "extraLeaves", "1" },
+	{ "extraRequests", "200" },
+	{ "mode", "0,1,2,3,4,5" },
+	{ "ttl", "0" },
+	{ "degree", "4" },
+	{ "workload", "" },
+	{ "search", "flood" },
+	{ "downloadWorkers", "4" }
+};
+
+const std::vector<std::string> metricNames = {
+	"throughput", "seconds", "startupSeconds", "requests", "searchP50Ms", "searchP99Ms", "searchP999Ms", "downloadP50Ms", "downloadP99Ms",
+	"messages", "bytes", "messagesPerQuery", "duplicateRatio", "valid", "invalid", "invalidRate", "failedQueries"
+};
+
+//Metrics checked against the baseline: (name, true if higher is better)
+const std::vector<std::pair<std::string, bool>> regressionMetrics = {
+	{ "throughput", true },
+	{ "searchP99Ms", false },
+	{ "messagesPerQuery", false },
+	{ "invalidRate", false }
+};
+
+struct Run {
+	std::vector<std::string> config; //Driver arguments, in driverParameters order
+	int repeat;
+	unsigned int seed;
+	bool ok;
+	std::map<std::string, double> metrics;
+};
+
+std::vector<std::string> split(const std::string &text, char separator);
+std::string configKey(const std::vector<std::string> &config);
+bool runOne(const std::string &simulation, const std::string &directory, Run &run, int timeoutSeconds);
+void writeCsv(const std::string &path, const std::vector<Run> &runs);
+void writeJson(const std::string &path, const std::vector<Run> &runs, const std::map<std::string, std::map<std::string, double>> &means);
+std::map<std::string, std::map<std::string, double>> meansOf(const std::vector<Run> &runs);
+std::map<std::string, std::map<std::string, double>> readBaseline(const std::string &path);
+int compareBaseline(const std::map<std::string, std::map<std::string, double>> &means, const std::map<std::string, std::map<std::string, double>> &baseline, double tolerance);
+void makeDirectory(const std::string &path);
+void setEnv(const char *name, const std::string &value);
+
+int main(int argc, char* argv[]) {
+	std::map<std::string, std::string> options;
+	for (auto &parameter : driverParameters) {
+		options[parameter.first] = parameter.second;
+	}
+	options["repeats"] = "3";
+	options["seed"] = "1";
+	options["out"] = "benchmark";
+	options["simulation"] = "./gnutella-simulation";
+	options["tolerance"] = std::to_string(DEFAULT_TOLERANCE);
+	options["timeout"] = std::to_string(DEFAULT_RUN_TIMEOUT_S);
+	options["trace"] = "1";
+	for (int i = 1; i < argc; i++) {
+		std::string arg(argv[i]);
+		size_t equals = arg.find('=');
+		std::string name = arg.substr(0, equals);
+		if (equals == std::string::npos || (options.find(name) == options.end() && name != "baseline")) {
+			std::cerr << "Unknown argument " << arg << std::endl;
+			return 2;
+		}
+		options[name] = arg.substr(equals + 1);
+	}
+	Log::start("benchmark");
+	//Query latencies come from the trace, so it is on unless asked otherwise
+	setEnv("GNUTELLA_TRACE", options["trace"]);
+	setEnv("GNUTELLA_LOG_LEVEL", "warn");
+	int repeats = std::stoi(options["repeats"]);
+	unsigned int seed = (unsigned int)std::stoul(options["seed"]);
+	//Expand the cartesian product of every swept parameter
+	std::vector<std::vector<std::string>> configs = { {} };
+	for (auto &parameter : driverParameters) {
+		std::vector<std::vector<std::string>> expanded;
+		for (auto &config : configs) {
+			std::vector<std::string> values = split(options[parameter.first], ',');
+			if (values.empty()) {
+				values.push_back("");
+			}
+			for (auto &value : values) {
+				expanded.push_back(config);
+				expanded.back().push_back(value);
+			}
+		}
+		configs = expanded;
+	}
+	std::string out = options["out"];
+	makeDirectory(out + "-runs");
+	//Runs start from their own directory, so find the simulation from here
+	std::string simulation = options["simulation"];
+	char currentPath[4096];
+	if (!simulation.empty() && simulation[0] != '/' && simulation.find(':') == std::string::npos && getcwd(currentPath, sizeof(currentPath)) != nullptr) {
+		simulation = std::string(currentPath) + "/" + simulation;
+	}
+	std::vector<Run> runs;
+	int total = int(configs.size()) * repeats;
+	for (auto &config : configs) {
+		for (int repeat = 0; repeat < repeats; repeat++) {
+			Run run;
+			run.config = config;
+			run.repeat = repeat;
+			run.seed = seed + repeat;
+			std::string directory = out + "-runs/" + std::to_string(runs.size());
+			LOG_WARN("Run " << runs.size() + 1 << "/" << total << ": " << configKey(config) << " seed " << run.seed);
+			run.ok = runOne(simulation, directory, run, std::stoi(options["timeout"]));
+			if (!run.ok) {
+				LOG_WARN("Run in " << directory << " failed, see its driver.log");
+			}
+			runs.push_back(run);
+			//Keep partial results if the sweep is interrupted
+			writeCsv(out + ".csv", runs);
+		}
+	}
+	auto means = meansOf(runs);
+	writeJson(out + ".json", runs, means);
+	LOG_WARN("Wrote " << out << ".csv and " << out << ".json");
+	int regressions = 0;
+	if (options.find("baseline") != options.end()) {
+		regressions = compareBaseline(means, readBaseline(options["baseline"]), std::stod(options["tolerance"]));
+	}
+	Log::shutdown();
+	return regressions > 0 ? 1 : 0;
+}
+
+std::vector<std::string> split(const std::string &text, char separator) {
+	std::vector<std::string> parts;
+	std::stringstream stream(text);
+	std::string part;
+	while (std::getline(stream, part, separator)) {
+		parts.push_back(part);
+	}
+	return parts;
+}
+
+std::string configKey(const std::vector<std::string> &config) {
+	std::string key;
+	for (unsigned int i = 0; i < config.size(); i++) {
+		key += (i == 0 ? "" : " ") + driverParameters[i].first + "=" + config[i];
+	}
+	return key;
+}
+
+bool runOne(const std::string &simulation, const std::string &directory, Run &run, int timeoutSeconds) {
+	//Runs the driver in a clean directory, since leaves keep their files under the working directory
+#ifdef _WIN32
+	std::string command = "(if exist \"" + directory + "\" rmdir /s /q \"" + directory + "\") && mkdir \"" + directory + "\" && cd /d \"" + directory + "\" && \"" + simulation + "\"";
+#else
+	std::string command = "rm -rf '" + directory + "' && mkdir -p '" + directory + "' && cd '" + directory + "' && timeout " + std::to_string(timeoutSeconds) + " '" + simulation + "'";
+#endif
+	//supers leavesPerSuper filesPerLeaf requestsPerLeaf topology duplicationFactor extraLeaves extraRequests mode TTL seed results degree
+	for (unsigned int i = 0; i < run.config.size(); i++) {
+		auto variable = environmentParameters.find(driverParameters[i].first);
+		if (variable != environmentParameters.end()) {
+			std::string value = run.config[i];
+			if (driverParameters[i].first == "workload") {
+				//Leaves draw arrivals and file sizes from the workload seed, so each repeat gets its own;
+				//it comes last so it wins over any seed in the swept value
+				value += (value.empty() ? "" : " ") + std::string("seed=") + std::to_string(run.seed);
+			}
+			setEnv(variable->second.c_str(), value);
+			continue;
+		}
+		if (driverParameters[i].first == "degree") {
+			command += " " + std::to_string(run.seed) + " results.txt";
+		}
+		command += " " + run.config[i];
+	}
+	command += " < " NULL_DEVICE " > driver.log 2>&1";
+	if (std::system(command.c_str()) != 0) {
+		return false;
+	}
+	std::ifstream results(directory + "/results.txt");
+	std::string name;
+	double value;
+	while (results >> name >> value) {
+		run.metrics[name] = value;
+	}
+	return !run.metrics.empty();
+}
+
+void writeCsv(const std::string &path, const std::vector<Run> &runs) {
+	std::ofstream out(path);
+	out << std::setprecision(10);
+	for (auto &parameter : driverParameters) {
+		out << parameter.first << ",";
+	}
+	out << "repeat,seed,ok";
+	for (auto &metric : metricNames) {
+		out << "," << metric;
+	}
+	out << std::endl;
+	for (auto &run : runs) {
+		for (auto &value : run.config) {
+			out << value << ",";
+		}
+		out << run.repeat << "," << run.seed << "," << (run.ok ? 1 : 0);
+		for (auto &metric : metricNames) {
+			out << ",";
+			auto value = run.metrics.find(metric);
+			if (value != run.metrics.end()) {
+				out << value->second;
+			}
+		}
+		out << std::endl;
+	}
+}
+
+void writeJson(const std::string &path, const std::vector<Run> &runs, const std::map<std::string, std::map<std::string, double>> &means) {
+	std::ofstream out(path);
+	out << std::setprecision(10);
+	out << "{" << std::endl << "  \"runs\": [" << std::endl;
+	for (unsigned int i = 0; i < runs.size(); i++) {
+		const Run &run = runs[i];
+		out << "    {";
+		for (unsigned int j = 0; j < run.config.size(); j++) {
+			bool number = !run.config[j].empty() && run.config[j].find_first_not_of("0123456789.-") == std::string::npos;
+			out << "\"" << driverParameters[j].first << "\": " << (number ? run.config[j] : "\"" + run.config[j] + "\"") << ", ";
+		}
+		out << "\"repeat\": " << run.repeat << ", \"seed\": " << run.seed << ", \"ok\": " << (run.ok ? "true" : "false");
+		for (auto &metric : run.metrics) {
+			out << ", \"" << metric.first << "\": " << (std::isfinite(metric.second) ? metric.second : 0);
+		}
+		out << "}" << (i + 1 < runs.size() ? "," : "") << std::endl;
+	}
+	out << "  ]," << std::endl << "  \"means\": {" << std::endl;
+	unsigned int written = 0;
+	for (auto &config : means) {
+		out << "    \"" << config.first << "\": {";
+		bool first = true;
+		for (auto &metric : config.second) {
+			out << (first ? "" : ", ") << "\"" << metric.first << "\": " << metric.second;
+			first = false;
+		}
+		out << "}" << (++written < means.size() ? "," : "") << std::endl;
+	}
+	out << "  }" << std::endl << "}" << std::endl;
+}
+
+std::map<std::string, std::map<std::string, double>> meansOf(const std::vector<Run> &runs) {
+	//Mean of every metric over the successful repeats of each configuration
+	std::map<std::string, std::map<std::string, double>> sums;
+	std::map<std::string, std::map<std::string, int>> counts;
+	for (auto &run : runs) {
+		if (!run.ok) {
+			continue;
+		}
+		std::string key = configKey(run.config);
+		for (auto &metric : run.metrics) {
+			if (std::isfinite(metric.second)) {
+				sums[key][metric.first] += metric.second;
+				counts[key][metric.first]++;
+			}
+		}
+	}
+	for (auto &config : sums) {
+		for (auto &metric : config.second) {
+			metric.second /= counts[config.first][metric.first];
+		}
+	}
+	return sums;
+}
+
+std::map<std::string, std::map<std::string, double>> readBaseline(const std::string &path) {
+	//Reads a CSV written by an earlier sweep back into runs and averages them the same way
+	std::ifstream in(path);
+	std::string line;
+	std::vector<Run> runs;
+	if (!std::getline(in, line)) {
+		LOG_WARN("Couldn't read baseline " << path);
+		return {};
+	}
+	std::vector<std::string> header = split(line, ',');
+	size_t nConfig = driverParameters.size();
+	while (std::getline(in, line)) {
+		std::vector<std::string> fields = split(line, ',');
+		if (fields.size() < nConfig + 3) {
+			continue;
+		}
+		Run run;
+		run.config.assign(fields.begin(), fields.begin() + nConfig);
+		run.repeat = std::stoi(fields[nConfig]);
+		run.seed = (unsigned int)std::stoul(fields[nConfig + 1]);
+		run.ok = fields[nConfig + 2] == "1";
+		for (size_t i = nConfig + 3; i < fields.size() && i < header.size(); i++) {
+			if (!fields[i].empty()) {
+				run.metrics[header[i]] = std::stod(fields[i]);
+			}
+		}
+		runs.push_back(run);
+	}
+	return meansOf(runs);
+}
+
+int compareBaseline(const std::map<std::string, std::map<std::string, double>> &means, const std::map<std::string, std::map<std::string, double>> &baseline, double tolerance) {
+	//Counts metrics that moved the wrong way by more than tolerance, relative to the baseline mean.
+	//Invalid rates are already fractions, so they are compared by absolute difference instead
+	int regressions = 0;
+	for (auto &config : means) {
+		auto before = baseline.find(config.first);
+		if (before == baseline.end()) {
+			continue;
+		}
+		for (auto &metric : regressionMetrics) {
+			auto now = config.second.find(metric.first);
+			auto was = before->second.find(metric.first);
+			if (now == config.second.end() || was == before->second.end()) {
+				continue;
+			}
+			double change = metric.first == "invalidRate" ? now->second - was->second : (was->second == 0 ? 0 : (now->second - was->second) / was->second);
+			if (metric.second) {
+				change = -change;
+			}
+			if (change > tolerance) {
+				LOG_WARN("Regression in " << config.first << ": " << metric.first << " " << was->second << " -> " << now->second);
+				regressions++;
+			}
+		}
+	}
+	LOG_WARN(regressions << " regressions against the baseline");
+	return regressions;
+}
+
+void makeDirectory(const std::string &path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+void setEnv(const char *name, const std::string &value) {
+#ifdef _WIN32
+	_putenv_s(name, value.c_str());
+#else
+	setenv(name, value.c_str(), 1);
+#endif
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include "Transport.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//Overlay startup shared by the driver, supers and leaves. connect calls a node until it answers; each
+//attempt waits twice as long as the one before, from BOOTSTRAP_FIRST_TIMEOUT_MS up to
+//BOOTSTRAP_MAX_TIMEOUT_MS, so a node that is already up answers the first attempt and a slow one isn't
+//hammered. connectAll reaches many nodes at once on up to BOOTSTRAP_PARALLELISM background jobs, so one
+//slow node no longer holds up the rest. Barrier counts the nodes that have reached a phase.
+
+#define BOOTSTRAP_FIRST_TIMEOUT_MS 50
+#define BOOTSTRAP_MAX_TIMEOUT_MS 1000
+#define BOOTSTRAP_PARALLELISM 16
+
+class Bootstrap {
+public:
+	//Returns a client to nodeId once a call to method succeeds
+	static std::shared_ptr<Client> connect(int nodeId, const std::string &method = "ping") {
+		long long timeoutMs = BOOTSTRAP_FIRST_TIMEOUT_MS;
+		while (true) {
+			std::shared_ptr<Client> client = std::make_shared<Client>("localhost", 8000 + nodeId);
+			client->set_timeout(timeoutMs);
+			try {
+				client->call(method);
+				client->clear_timeout();
+				return client;
+			}
+			catch (TimeoutError &) {
+				//Try again on a fresh client, giving the node longer
+				timeoutMs = std::min<long long>(timeoutMs * 2, BOOTSTRAP_MAX_TIMEOUT_MS);
+			}
+		}
+	}
+
+	//connect for every node in nodeIds, concurrently
+	static std::unordered_map<int, std::shared_ptr<Client>> connectAll(const std::vector<int> &nodeIds, const std::string &method = "ping") {
+		struct Progress {
+			std::unordered_map<int, std::shared_ptr<Client>> clients;
+			std::atomic<size_t> next;
+			size_t finished;
+			std::mutex lock;
+			std::condition_variable done;
+		};
+		std::shared_ptr<Progress> progress = std::make_shared<Progress>();
+		progress->next = 0;
+		progress->finished = 0;
+		size_t nWorkers = std::min<size_t>(BOOTSTRAP_PARALLELISM, nodeIds.size());
+		for (size_t i = 0; i < nWorkers; i++) {
+			runInBackground([progress, nodeIds, method]() {
+				for (size_t index = progress->next++; index < nodeIds.size(); index = progress->next++) {
+					std::shared_ptr<Client> client = connect(nodeIds[index], method);
+					progress->lock.lock();
+					progress->clients[nodeIds[index]] = client;
+					progress->lock.unlock();
+				}
+				progress->lock.lock();
+				progress->finished++;
+				progress->lock.unlock();
+				progress->done.notify_all();
+			});
+		}
+		std::unique_lock<std::mutex> unique(progress->lock);
+		progress->done.wait(unique, [&progress, nWorkers] { return progress->finished == nWorkers; });
+		return std::move(progress->clients);
+	}
+};
+
+//Counts arrivals at one startup or shutdown phase and lets a thread wait for enough of them
+class Barrier {
+public:
+	Barrier() : count(0) {}
+
+	void arrive() {
+		lock.lock();
+		count++;
+		lock.unlock();
+		arrived.notify_all();
+	}
+
+	void wait(int expected) {
+		std::unique_lock<std::mutex> unique(lock);
+		arrived.wait(unique, [this, expected] { return count >= expected; });
+	}
+
+	//Returns whether expected arrivals came within timeoutMs
+	bool waitFor(int expected, long long timeoutMs) {
+		std::unique_lock<std::mutex> unique(lock);
+		return arrived.wait_for(unique, std::chrono::milliseconds(timeoutMs), [this, expected] { return count >= expected; });
+	}
+
+	int arrivals() {
+		std::lock_guard<std::mutex> guard(lock);
+		return count;
+	}
+
+private:
+	int count;
+	std::mutex lock;
+	std::condition_variable arrived;
+};
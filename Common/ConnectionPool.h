@@ -0,0 +1,102 @@
+#pragma once
+#include "Transport.h"
+#include <array>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+//Clients to other nodes, keyed by node ID, shared by every thread of a node. At most capacity connections
+//stay open: the least recently used one is closed to make room for a new peer. Callers get a shared_ptr,
+//so a connection evicted while a call is using it stays open until the call is done. Evicted connections
+//are kept for CONNECTION_RETIRE_MS more so fire-and-forget messages already queued on them still go out.
+//A connection the transport reports as lost, or that a caller discards after a failure, is replaced by a
+//fresh one on the next get.
+
+#define CONNECTION_POOL_CAPACITY 64
+#define CONNECTION_RETIRE_MS 2000
+
+class ConnectionPool {
+public:
+	explicit ConnectionPool(size_t capacity = CONNECTION_POOL_CAPACITY) : capacity(capacity), reuses(0), connects(0), evictions(0), reconnects(0) {}
+
+	std::shared_ptr<Client> get(int nodeId) {
+		std::lock_guard<std::mutex> guard(lock);
+		retire(nullptr);
+		auto entry = entries.find(nodeId);
+		if (entry != entries.end()) {
+			if (!connectionLost(*entry->second.client)) {
+				lru.splice(lru.begin(), lru, entry->second.position);
+				reuses++;
+				return entry->second.client;
+			}
+			reconnects++;
+			retire(entry->second.client);
+			lru.erase(entry->second.position);
+			entries.erase(entry);
+		}
+		while (entries.size() >= capacity && !lru.empty()) {
+			auto victim = entries.find(lru.back());
+			retire(victim->second.client);
+			entries.erase(victim);
+			lru.pop_back();
+			evictions++;
+		}
+		connects++;
+		lru.push_front(nodeId);
+		std::shared_ptr<Client> client = std::make_shared<Client>("localhost", 8000 + nodeId);
+		entries[nodeId] = { client, lru.begin() };
+		return client;
+	}
+
+	//Takes effect as connections are next opened
+	void setCapacity(size_t connections) {
+		std::lock_guard<std::mutex> guard(lock);
+		capacity = connections;
+	}
+
+	//Drops client if it is still nodeId's connection, e.g. after a call on it timed out
+	void discard(int nodeId, const std::shared_ptr<Client> &client) {
+		std::lock_guard<std::mutex> guard(lock);
+		auto entry = entries.find(nodeId);
+		if (entry != entries.end() && entry->second.client == client) {
+			reconnects++;
+			retire(entry->second.client);
+			lru.erase(entry->second.position);
+			entries.erase(entry);
+		}
+	}
+
+	//Returns {reuses, new connections, evictions, reconnects, open}
+	std::array<long long, 5> stats() {
+		std::lock_guard<std::mutex> guard(lock);
+		return { reuses, connects, evictions, reconnects, (long long)(entries.size() + retired.size()) };
+	}
+
+private:
+	struct Entry {
+		std::shared_ptr<Client> client;
+		std::list<int>::iterator position;
+	};
+
+	//Caller holds lock. Queues client for closing, and closes the ones whose grace period is over
+	void retire(const std::shared_ptr<Client> &client) {
+		auto now = std::chrono::steady_clock::now();
+		while (!retired.empty() && now - retired.front().first > std::chrono::milliseconds(CONNECTION_RETIRE_MS)) {
+			retired.pop_front();
+		}
+		if (client) {
+			retired.push_back({ now, client });
+		}
+	}
+
+	size_t capacity;
+	std::mutex lock;
+	std::unordered_map<int, Entry> entries;
+	std::list<int> lru;
+	std::deque<std::pair<std::chrono::steady_clock::time_point, std::shared_ptr<Client>>> retired;
+	long long reuses, connects, evictions, reconnects;
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+//Files are identified on the wire and in every index by a 64-bit hash of their name. Every node
+//derives the same ID on its own, so names are only sent when a leaf registers a file and only
+//needed where files are read or written. Super-peers reject a registration whose ID is already
+//taken by a different name.
+typedef uint64_t FileId;
+
+inline FileId fileIdOf(const std::string &fileName) {
+	//64-bit FNV-1a
+	FileId hash = 14695981039346656037ULL;
+	for (unsigned char c : fileName) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
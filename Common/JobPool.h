@@ -0,0 +1,98 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+//Process-wide pool for node jobs that may block on calls of their own (downloads, registrations, lease
+//audits, periodic pushes), plus one timer thread that hands jobs to the pool when they're due. Workers
+//start when a job finds none idle, up to JOB_POOL_MAX_WORKERS, and then stay for the life of the
+//process, so scheduling work costs no thread creation once the pool has grown to the busiest moment.
+
+#define JOB_POOL_MAX_WORKERS 32
+
+class JobPool {
+public:
+	static JobPool &instance() {
+		static JobPool pool;
+		return pool;
+	}
+
+	//Runs job on a pool worker
+	void run(std::function<void()> job) {
+		jobLock.lock();
+		jobs.push_back(std::move(job));
+		if (idle < (int)jobs.size() && workers < JOB_POOL_MAX_WORKERS) {
+			workers++;
+			std::thread(&JobPool::work, this).detach();
+		}
+		jobLock.unlock();
+		jobReady.notify_one();
+	}
+
+	//Runs job on a pool worker once delay has passed
+	void after(std::chrono::milliseconds delay, std::function<void()> job) {
+		timerLock.lock();
+		if (!timerStarted) {
+			std::thread(&JobPool::runTimers, this).detach();
+			timerStarted = true;
+		}
+		auto due = std::chrono::steady_clock::now() + delay;
+		bool earliest = timers.empty() || due < timers.begin()->first;
+		timers.emplace(due, std::move(job));
+		timerLock.unlock();
+		if (earliest) {
+			timerChanged.notify_one();
+		}
+	}
+
+private:
+	JobPool() : workers(0), idle(0), timerStarted(false) {}
+
+	void work() {
+		std::unique_lock<std::mutex> guard(jobLock);
+		while (true) {
+			idle++;
+			jobReady.wait(guard, [this] { return !jobs.empty(); });
+			idle--;
+			std::function<void()> job = std::move(jobs.front());
+			jobs.pop_front();
+			guard.unlock();
+			job();
+			guard.lock();
+		}
+	}
+
+	void runTimers() {
+		std::unique_lock<std::mutex> guard(timerLock);
+		while (true) {
+			if (timers.empty()) {
+				timerChanged.wait(guard);
+				continue;
+			}
+			auto next = timers.begin();
+			if (next->first > std::chrono::steady_clock::now()) {
+				timerChanged.wait_until(guard, next->first);
+				continue;
+			}
+			std::function<void()> job = std::move(next->second);
+			timers.erase(next);
+			guard.unlock();
+			run(std::move(job));
+			guard.lock();
+		}
+	}
+
+	std::mutex jobLock;
+	std::condition_variable jobReady;
+	std::deque<std::function<void()>> jobs;
+	int workers;
+	int idle;
+	std::mutex timerLock;
+	std::condition_variable timerChanged;
+	std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timers;
+	bool timerStarted;
+};
@@ -0,0 +1,270 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Asynchronous logging shared by the driver, super-peers and leaves. Each thread appends records to its
+//own lock-free ring and a single background thread drains every ring to the console, and optionally to a
+//binary log, so RPC handlers never wait on console I/O. A full ring drops the record rather than block.
+//
+//Settings come from the environment so the driver passes them on to every process it spawns:
+//GNUTELLA_LOG_LEVEL is one of debug, info, warn or error, and GNUTELLA_LOG_BINARY is a path prefix
+//that turns on the binary log. LOG_DEBUG statements compile away unless LOG_MIN_LEVEL allows them,
+//which by default it only does in debug builds.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+//Every logging thread owns a ring, and the simulation runs a thread per node, so its rings are smaller
+#ifdef GNUTELLA_SIMULATION
+#define LOG_RING_SIZE 256
+#else
+#define LOG_RING_SIZE 4096
+#endif
+#define LOG_POLL_MS 2
+
+#define LOG_AT(level, expr) do { if (Log::enabled(level)) { std::ostringstream logStream; logStream << expr; Log::write(level, logStream.str()); } } while (0)
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+#else
+#define LOG_DEBUG(expr) do {} while (0)
+#endif
+#define LOG_INFO(expr) LOG_AT(LOG_LEVEL_INFO, expr)
+#define LOG_WARN(expr) LOG_AT(LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+
+class Log {
+public:
+	//Applies the environment settings; name picks the binary log file. Only the first call counts, so
+	//in the simulation build the driver's settings hold for every node
+	static void start(const std::string &name) {
+		State &log = state();
+		if (log.started.exchange(true)) {
+			return;
+		}
+		std::string level = env("GNUTELLA_LOG_LEVEL");
+		if (level == "debug") {
+			log.level = LOG_LEVEL_DEBUG;
+		}
+		else if (level == "info") {
+			log.level = LOG_LEVEL_INFO;
+		}
+		else if (level == "warn") {
+			log.level = LOG_LEVEL_WARN;
+		}
+		else if (level == "error") {
+			log.level = LOG_LEVEL_ERROR;
+		}
+		std::string binaryPrefix = env("GNUTELLA_LOG_BINARY");
+		if (!binaryPrefix.empty()) {
+			std::lock_guard<std::mutex> guard(log.drainLock);
+			log.binary.open(binaryPrefix + name + ".binlog", std::ios::binary | std::ios::trunc);
+		}
+	}
+
+	static bool enabled(int level) {
+		return level >= LOG_MIN_LEVEL && level >= state().level.load(std::memory_order_relaxed);
+	}
+
+	static void write(int level, std::string message) {
+		Ring &ring = localRing();
+		uint64_t head = ring.head.load(std::memory_order_relaxed);
+		if (head - ring.tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+			state().dropped++;
+			return;
+		}
+		Record &record = ring.records[head % LOG_RING_SIZE];
+		record.micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		record.level = level;
+		record.message = std::move(message);
+		ring.head.store(head + 1, std::memory_order_release);
+	}
+
+	//Writes out everything logged so far, e.g. before blocking on console input
+	static void flush() {
+		std::lock_guard<std::mutex> guard(state().drainLock);
+		drain();
+	}
+
+	static void shutdown() {
+		State &log = state();
+		if (log.running.exchange(false) && log.writer.joinable()) {
+			log.writer.join();
+		}
+		std::lock_guard<std::mutex> guard(log.drainLock);
+		drain();
+		log.binary.close();
+	}
+
+	static long long dropped() {
+		return state().dropped;
+	}
+
+	//Reads an environment variable, empty if unset
+	static std::string env(const char *name) {
+#ifdef _MSC_VER
+		char *value = nullptr;
+		size_t length = 0;
+		std::string result;
+		if (_dupenv_s(&value, &length, name) == 0 && value != nullptr) {
+			result = value;
+			free(value);
+		}
+		return result;
+#else
+		const char *value = std::getenv(name);
+		return value == nullptr ? std::string() : std::string(value);
+#endif
+	}
+
+private:
+	struct Record {
+		long long micros;
+		int level;
+		std::string message;
+	};
+
+	//Single-producer, single-consumer ring owned by one logging thread
+	struct Ring {
+		explicit Ring(uint32_t index) : index(index), head(0), tail(0), retired(false), records(LOG_RING_SIZE) {}
+		uint32_t index;
+		std::atomic<uint64_t> head;
+		std::atomic<uint64_t> tail;
+		std::atomic<bool> retired; //Set once its thread has exited; the writer drops it when drained
+		std::vector<Record> records;
+	};
+
+	//Per-thread handle on the thread's ring, retiring it when the thread exits
+	struct RingOwner {
+		~RingOwner() {
+			if (ring) {
+				ring->retired.store(true, std::memory_order_release);
+			}
+		}
+		std::shared_ptr<Ring> ring;
+	};
+
+	struct State {
+		State() : level(LOG_MIN_LEVEL), dropped(0), running(false), started(false), nextRing(0) {}
+		~State() {
+			if (running.exchange(false) && writer.joinable()) {
+				writer.join();
+			}
+		}
+		std::atomic<int> level;
+		std::atomic<long long> dropped;
+		std::atomic<bool> running;
+		std::atomic<bool> started;
+		std::mutex ringsLock; //Only taken when a thread logs for the first time and when the writer lists rings
+		std::vector<std::shared_ptr<Ring>> rings; //Rings of live threads, plus retired ones not yet drained
+		uint32_t nextRing; //Thread number for the binary log, never reused
+		std::mutex drainLock; //Keeps the rings single-consumer
+		std::ofstream binary;
+		std::thread writer;
+	};
+
+	static State &state() {
+		static State instance;
+		return instance;
+	}
+
+	static Ring &localRing() {
+		thread_local RingOwner owner;
+		if (!owner.ring) {
+			State &log = state();
+			std::lock_guard<std::mutex> guard(log.ringsLock);
+			owner.ring = std::make_shared<Ring>(log.nextRing++);
+			log.rings.push_back(owner.ring);
+			if (!log.running.exchange(true)) {
+				log.writer = std::thread(writerLoop);
+			}
+		}
+		return *owner.ring;
+	}
+
+	static void writerLoop() {
+		State &log = state();
+		while (log.running) {
+			bool wrote;
+			{
+				std::lock_guard<std::mutex> guard(log.drainLock);
+				wrote = drain();
+			}
+			if (!wrote) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(LOG_POLL_MS));
+			}
+		}
+	}
+
+	//Caller holds drainLock. Returns whether anything was written
+	static bool drain() {
+		State &log = state();
+		std::vector<std::shared_ptr<Ring>> rings;
+		{
+			std::lock_guard<std::mutex> guard(log.ringsLock);
+			rings = log.rings;
+		}
+		bool wrote = false;
+		bool anyRetired = false;
+		for (auto &ring : rings) {
+			//Checked before reading head, so a retired ring has nothing left once drained up to it
+			bool retired = ring->retired.load(std::memory_order_acquire);
+			anyRetired = anyRetired || retired;
+			uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			for (; tail != head; tail++) {
+				Record &record = ring->records[tail % LOG_RING_SIZE];
+				static const char *prefixes[] = { "[debug] ", "", "[warn] ", "[error] " };
+				std::cout << prefixes[record.level] << record.message << '\n';
+				if (log.binary.is_open()) {
+					//[int64 micros][uint8 level][uint32 thread][uint32 length][message bytes]
+					uint8_t level = uint8_t(record.level);
+					uint32_t length = uint32_t(record.message.size());
+					log.binary.write((const char *)&record.micros, sizeof(record.micros));
+					log.binary.write((const char *)&level, sizeof(level));
+					log.binary.write((const char *)&ring->index, sizeof(ring->index));
+					log.binary.write((const char *)&length, sizeof(length));
+					log.binary.write(record.message.data(), length);
+				}
+				record.message.clear();
+				wrote = true;
+			}
+			ring->tail.store(tail, std::memory_order_release);
+		}
+		if (anyRetired) {
+			//Drop rings whose threads have exited now that they're drained, so short-lived threads don't
+			//leave their rings behind
+			std::lock_guard<std::mutex> guard(log.ringsLock);
+			log.rings.erase(std::remove_if(log.rings.begin(), log.rings.end(), [](const std::shared_ptr<Ring> &ring) {
+				return ring->retired.load(std::memory_order_acquire) && ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire);
+			}), log.rings.end());
+		}
+		if (wrote) {
+			std::cout.flush();
+			if (log.binary.is_open()) {
+				log.binary.flush();
+			}
+		}
+		return wrote;
+	}
+};
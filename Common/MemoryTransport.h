@@ -0,0 +1,350 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "JobPool.h"
+#include "WireSize.h"
+
+//In-memory backend of Transport.h for the simulation build. Servers register under their port number in
+//one process-wide table. Arguments and replies are moved between caller and handler as typed objects,
+//with no serialization. Synchronous calls run the handler on the calling thread. Asynchronous calls are
+//queued for a shared pool of worker threads, which stands in for rpclib's per-server threads. Node jobs
+//that may block on calls of their own run on JobPool instead, so they never hold up message delivery.
+
+#define MEMORY_TRANSPORT_MIN_WORKERS 4
+
+class Server;
+
+class RemoteError : public std::runtime_error {
+public:
+	explicit RemoteError(const std::string &message) : std::runtime_error(message) {}
+};
+
+class TimeoutError : public std::runtime_error {
+public:
+	explicit TimeoutError(const std::string &message) : std::runtime_error(message) {}
+};
+
+//Return value of a handler, handed over as is. Like rpclib's object_handle it can only be moved. Its
+//encoded size is only worked out if the stats ask for it, which they do before the value is taken
+class Reply {
+public:
+	Reply() : type(&typeid(void)), sizer(nullptr) {}
+	Reply(Reply &&) = default;
+	Reply &operator=(Reply &&) = default;
+	Reply(const Reply &) = delete;
+	Reply &operator=(const Reply &) = delete;
+
+	template <typename T>
+	static Reply of(T value) {
+		Reply reply;
+		reply.sizer = [](const void *stored) {
+			return wireSize(*static_cast<const T *>(stored));
+		};
+		reply.type = &typeid(T);
+		reply.value = std::make_shared<T>(std::move(value));
+		return reply;
+	}
+
+	template <typename T>
+	T as() const & {
+		return stored<T>();
+	}
+
+	//A temporary reply gives up its value instead of copying it
+	template <typename T>
+	T as() && {
+		return std::move(stored<T>());
+	}
+
+	long long encodedSize() const {
+		return sizer == nullptr ? 1 : sizer(value.get());
+	}
+
+private:
+	template <typename T>
+	T &stored() const {
+		if (!value || *type != typeid(T)) {
+			throw RemoteError(std::string("Reply does not hold a ") + typeid(T).name());
+		}
+		return *static_cast<T *>(value.get());
+	}
+
+	std::shared_ptr<void> value;
+	const std::type_info *type;
+	long long (*sizer)(const void *);
+};
+
+inline long long wireSize(const Reply &reply) {
+	return reply.encodedSize();
+}
+
+//Process-wide table of listening servers plus the worker pool that runs asynchronous calls
+class MemoryNetwork {
+public:
+	static MemoryNetwork &instance() {
+		static MemoryNetwork network;
+		return network;
+	}
+
+	void listen(int port, Server *server) {
+		serversLock.lock();
+		servers[port] = server;
+		serversLock.unlock();
+		serverAdded.notify_all();
+	}
+
+	void close(int port, Server *server) {
+		serversLock.lock();
+		auto entry = servers.find(port);
+		if (entry != servers.end() && entry->second == server) {
+			servers.erase(entry);
+		}
+		serversLock.unlock();
+	}
+
+	//Waits up to timeoutMs (forever if negative) for a server to listen on port
+	Server *connect(int port, long long timeoutMs) {
+		std::unique_lock<std::mutex> guard(serversLock);
+		auto listening = [this, port] { return servers.find(port) != servers.end(); };
+		if (timeoutMs < 0) {
+			serverAdded.wait(guard, listening);
+		}
+		else if (!serverAdded.wait_for(guard, std::chrono::milliseconds(timeoutMs), listening)) {
+			throw TimeoutError("Nothing listening on port " + std::to_string(port));
+		}
+		return servers[port];
+	}
+
+	Server *find(int port) {
+		serversLock.lock();
+		auto entry = servers.find(port);
+		Server *server = entry == servers.end() ? nullptr : entry->second;
+		serversLock.unlock();
+		return server;
+	}
+
+	void post(std::function<void()> task) {
+		queueLock.lock();
+		if (workers.empty()) {
+			int nWorkers = std::max<int>(MEMORY_TRANSPORT_MIN_WORKERS, int(std::thread::hardware_concurrency()));
+			for (int i = 0; i < nWorkers; i++) {
+				workers.push_back(std::thread(&MemoryNetwork::work, this));
+				workers.back().detach();
+			}
+		}
+		tasks.push_back(std::move(task));
+		queueLock.unlock();
+		taskReady.notify_one();
+	}
+
+private:
+	void work() {
+		std::unique_lock<std::mutex> guard(queueLock);
+		while (true) {
+			taskReady.wait(guard, [this] { return !tasks.empty(); });
+			std::function<void()> task = std::move(tasks.front());
+			tasks.pop_front();
+			guard.unlock();
+			task();
+			guard.lock();
+		}
+	}
+
+	std::mutex serversLock;
+	std::condition_variable serverAdded;
+	std::unordered_map<int, Server *> servers;
+	std::mutex queueLock;
+	std::condition_variable taskReady;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> workers;
+};
+
+//State of the handler running on this thread, for respondError and stopServer
+struct HandlerContext {
+	HandlerContext(Server *server, std::string *error) : server(server), error(error), outer(current()) {
+		current() = this;
+	}
+	~HandlerContext() {
+		current() = outer;
+	}
+	static HandlerContext *&current() {
+		thread_local HandlerContext *context = nullptr;
+		return context;
+	}
+	Server *server;
+	std::string *error;
+	HandlerContext *outer;
+};
+
+class Server {
+public:
+	explicit Server(int port) : port(port) {}
+	Server(const std::string &, int port) : port(port) {}
+	~Server() {
+		stop();
+	}
+
+	template <typename F>
+	void bind(const std::string &name, F handler) {
+		handlers[name] = wrap(handler, &F::operator());
+	}
+
+	template <typename R, typename... Args>
+	void bind(const std::string &name, R (*handler)(Args...)) {
+		handlers[name] = wrap<R, Args...>(handler);
+	}
+
+	//Handlers run on the caller's thread or the shared pool, so the thread count is ignored
+	void async_run(size_t = 1) {
+		MemoryNetwork::instance().listen(port, this);
+	}
+
+	void stop() {
+		MemoryNetwork::instance().close(port, this);
+	}
+
+	Reply dispatch(const std::string &name, const std::shared_ptr<void> &arguments, const std::type_info &type) {
+		auto handler = handlers.find(name);
+		if (handler == handlers.end()) {
+			throw RemoteError("No handler bound for " + name);
+		}
+		std::string error;
+		HandlerContext context(this, &error);
+		Reply reply = handler->second(arguments, type);
+		if (!error.empty()) {
+			throw RemoteError(error);
+		}
+		return reply;
+	}
+
+private:
+	typedef std::function<Reply(const std::shared_ptr<void> &, const std::type_info &)> Handler;
+
+	template <typename R>
+	struct Invoker {
+		template <typename F, typename Arguments, size_t... I>
+		static Reply run(F &handler, Arguments &arguments, std::index_sequence<I...>) {
+			return Reply::of(handler(std::move(std::get<I>(arguments))...));
+		}
+	};
+
+	template <typename F, typename R, typename... Args>
+	static Handler wrap(F handler, R (F::*)(Args...) const) {
+		return wrap<R, Args...>(handler);
+	}
+
+	template <typename R, typename... Args, typename F>
+	static Handler wrap(F handler) {
+		return [handler](const std::shared_ptr<void> &arguments, const std::type_info &type) mutable -> Reply {
+			typedef std::tuple<typename std::decay<Args>::type...> Arguments;
+			if (type != typeid(Arguments)) {
+				throw RemoteError("Arguments don't match the handler");
+			}
+			return Invoker<R>::run(handler, *static_cast<Arguments *>(arguments.get()), std::index_sequence_for<Args...>());
+		};
+	}
+
+	std::unordered_map<std::string, Handler> handlers;
+	int port;
+};
+
+//Handlers without a return value reply with nil
+template <>
+struct Server::Invoker<void> {
+	template <typename F, typename Arguments, size_t... I>
+	static Reply run(F &handler, Arguments &arguments, std::index_sequence<I...>) {
+		handler(std::move(std::get<I>(arguments))...);
+		return Reply();
+	}
+};
+
+class Client {
+public:
+	Client(const std::string &, int port) : port(port), timeoutMs(-1) {}
+
+	template <typename... Args>
+	Reply call(const std::string &name, Args... args) {
+		Server *server = MemoryNetwork::instance().connect(port, timeoutMs);
+		std::shared_ptr<void> arguments = std::make_shared<std::tuple<Args...>>(std::move(args)...);
+		return server->dispatch(name, arguments, typeid(std::tuple<Args...>));
+	}
+
+	template <typename... Args>
+	std::future<Reply> async_call(const std::string &name, Args... args) {
+		std::shared_ptr<void> arguments = std::make_shared<std::tuple<Args...>>(std::move(args)...);
+		std::shared_ptr<std::promise<Reply>> promise = std::make_shared<std::promise<Reply>>();
+		std::future<Reply> reply = promise->get_future();
+		int target = port;
+		MemoryNetwork::instance().post([target, name, arguments, promise] {
+			try {
+				Server *server = MemoryNetwork::instance().find(target);
+				if (server == nullptr) {
+					throw RemoteError("Nothing listening on port " + std::to_string(target));
+				}
+				promise->set_value(server->dispatch(name, arguments, typeid(std::tuple<Args...>)));
+			}
+			catch (...) {
+				promise->set_exception(std::current_exception());
+			}
+		});
+		return reply;
+	}
+
+	void set_timeout(long long milliseconds) {
+		timeoutMs = milliseconds;
+	}
+
+	void clear_timeout() {
+		timeoutMs = -1;
+	}
+
+private:
+	int port;
+	long long timeoutMs;
+};
+
+inline void respondError(const std::string &message) {
+	HandlerContext *context = HandlerContext::current();
+	if (context != nullptr) {
+		*context->error = message;
+	}
+}
+
+inline void stopServer() {
+	HandlerContext *context = HandlerContext::current();
+	if (context != nullptr) {
+		context->server->stop();
+	}
+}
+
+//Clients hold no connection, so there is nothing to lose
+inline bool connectionLost(Client &) {
+	return false;
+}
+
+//Runs a node job on the shared job pool
+inline void runInBackground(std::function<void()> job) {
+	JobPool::instance().run(std::move(job));
+}
+
+//Runs a node job on the shared job pool once delay has passed
+inline void runAfter(std::chrono::milliseconds delay, std::function<void()> job) {
+	JobPool::instance().after(delay, std::move(job));
+}
@@ -0,0 +1,313 @@
+#pragma once
+#include "Transport.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//Per-method RPC counters and latency histograms, served by every node's stats RPC. Handlers bound with
+//Stats::bind are timed from the moment the transport hands them their arguments until they return. Calls
+//sent with Stats::call and Stats::asyncCall are timed until their reply is read, so fire-and-forget
+//messages only add to the call and byte counts. Byte counts are the msgpack size of the arguments and
+//replies, worked out by WireSize.h rather than by encoding them again. A handler's entry is found when it
+//is bound, and each thread finds an outbound method's entry on its first call, so calls don't share a
+//lock. The simulation build runs every node in one process, so there the counts cover all of them.
+
+#define STATS_INBOUND 0
+#define STATS_OUTBOUND 1
+
+//Log-linear buckets: values below 2^STATS_SUB_BUCKET_BITS get a bucket each, and every power of two
+//above that is split into 2^STATS_SUB_BUCKET_BITS buckets, keeping each within 12.5% of its values
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+typedef std::vector<std::pair<int, long long>> SparseHistogram; // (bucket, count) for non-empty buckets
+typedef std::tuple<std::string, int, long long, long long, long long, long long, SparseHistogram> MethodReport; // (method, direction, calls, in flight, bytes in, bytes out, latency in microseconds)
+
+class LatencyHistogram {
+public:
+	LatencyHistogram() {
+		for (auto &count : counts) {
+			count = 0;
+		}
+	}
+
+	void record(long long micros) {
+		counts[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	SparseHistogram sparse() const {
+		SparseHistogram buckets;
+		for (int i = 0; i < STATS_BUCKETS; i++) {
+			long long count = counts[i].load(std::memory_order_relaxed);
+			if (count > 0) {
+				buckets.push_back({ i, count });
+			}
+		}
+		return buckets;
+	}
+
+	static int bucketOf(long long value) {
+		if (value < STATS_SUB_BUCKETS) {
+			return value < 0 ? 0 : int(value);
+		}
+		int shift = 0;
+		while ((value >> shift) >= 2 * STATS_SUB_BUCKETS) {
+			shift++;
+		}
+		return (shift + 1) * STATS_SUB_BUCKETS + int(value >> shift) - STATS_SUB_BUCKETS;
+	}
+
+	//Largest value that falls in the bucket
+	static long long valueOf(int bucket) {
+		if (bucket < STATS_SUB_BUCKETS) {
+			return bucket;
+		}
+		int shift = bucket / STATS_SUB_BUCKETS - 1;
+		long long top = bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+		return ((top + 1) << shift) - 1;
+	}
+
+	//Value at quantile q (0 to 1) of a histogram merged into bucket -> count form
+	static long long percentile(const std::map<int, long long> &buckets, double q) {
+		long long total = 0;
+		for (auto &bucket : buckets) {
+			total += bucket.second;
+		}
+		long long rank = (long long)(q * total);
+		long long seen = 0;
+		for (auto &bucket : buckets) {
+			seen += bucket.second;
+			if (seen > rank) {
+				return valueOf(bucket.first);
+			}
+		}
+		return buckets.empty() ? 0 : valueOf(buckets.rbegin()->first);
+	}
+
+private:
+	std::array<std::atomic<long long>, STATS_BUCKETS> counts;
+};
+
+struct MethodStats {
+	MethodStats() : calls(0), inFlight(0), bytesIn(0), bytesOut(0) {}
+	std::atomic<long long> calls;
+	std::atomic<long long> inFlight;
+	std::atomic<long long> bytesIn;
+	std::atomic<long long> bytesOut;
+	LatencyHistogram latency;
+};
+
+class Stats {
+public:
+	//Reply of an outbound call that records its latency when read
+	class PendingCall {
+	public:
+		PendingCall(MethodStats *stats, std::future<Reply> reply) : stats(stats), reply(std::move(reply)), sent(std::chrono::steady_clock::now()), done(false) {}
+		PendingCall(PendingCall &&other) noexcept : stats(other.stats), reply(std::move(other.reply)), sent(other.sent), done(other.done) {
+			other.done = true;
+		}
+		PendingCall &operator=(PendingCall &&other) noexcept {
+			finish();
+			stats = other.stats;
+			reply = std::move(other.reply);
+			sent = other.sent;
+			done = other.done;
+			other.done = true;
+			return *this;
+		}
+		~PendingCall() {
+			finish();
+		}
+
+		template <typename Duration>
+		std::future_status wait_for(const Duration &timeout) const {
+			return reply.wait_for(timeout);
+		}
+
+		Reply get() {
+			try {
+				Reply result = reply.get();
+				stats->bytesIn += wireSize(result);
+				stats->latency.record(elapsedMicros(sent));
+				finish();
+				return result;
+			}
+			catch (...) {
+				stats->latency.record(elapsedMicros(sent));
+				finish();
+				throw;
+			}
+		}
+
+	private:
+		void finish() {
+			if (!done) {
+				stats->inFlight--;
+				done = true;
+			}
+		}
+
+		MethodStats *stats;
+		std::future<Reply> reply;
+		std::chrono::steady_clock::time_point sent;
+		bool done;
+	};
+
+	static MethodStats &inbound(const std::string &method) {
+		return lookup(state().inbound, method);
+	}
+
+	//method is a string literal; each thread caches its entry by the literal's address
+	static MethodStats &outbound(const char *method) {
+		thread_local std::unordered_map<const char *, MethodStats *> cached;
+		MethodStats *&stats = cached[method];
+		if (stats == nullptr) {
+			stats = &lookup(state().outbound, method);
+		}
+		return *stats;
+	}
+
+	//Binds node's handler under name, counting and timing every call to it
+	template <typename C, typename R, typename... Args>
+	static void bind(Server &server, const std::string &name, C *node, R (C::*handler)(Args...)) {
+		MethodStats *stats = &inbound(name);
+		server.bind(name, [stats, node, handler](Args... args) -> R {
+			stats->calls++;
+			stats->bytesIn += argumentsSize(args...);
+			Timer timer(stats);
+			return Invoker<R>::run(stats, [node, handler](Args&&... forwarded) -> R {
+				return (node->*handler)(std::forward<Args>(forwarded)...);
+			}, std::move(args)...);
+		});
+	}
+
+	template <typename... Args>
+	static Reply call(Client *client, const char *name, Args... args) {
+		MethodStats *stats = &outbound(name);
+		stats->calls++;
+		stats->bytesOut += argumentsSize(args...);
+		Timer timer(stats);
+		Reply result = client->call(name, std::move(args)...);
+		stats->bytesIn += wireSize(result);
+		return result;
+	}
+
+	template <typename... Args>
+	static PendingCall asyncCall(Client *client, const char *name, Args... args) {
+		MethodStats *stats = &outbound(name);
+		stats->calls++;
+		stats->bytesOut += argumentsSize(args...);
+		stats->inFlight++;
+		return PendingCall(stats, client->async_call(name, std::move(args)...));
+	}
+
+	//Pooled connections, see ConnectionPool.h
+	template <typename... Args>
+	static Reply call(const std::shared_ptr<Client> &client, const char *name, Args... args) {
+		return call(client.get(), name, std::move(args)...);
+	}
+
+	template <typename... Args>
+	static PendingCall asyncCall(const std::shared_ptr<Client> &client, const char *name, Args... args) {
+		return asyncCall(client.get(), name, std::move(args)...);
+	}
+
+	//Handler for the stats RPC
+	static std::vector<MethodReport> report() {
+		State &stats = state();
+		std::vector<MethodReport> reports;
+		std::lock_guard<std::mutex> guard(stats.methodsLock);
+		for (auto &method : stats.inbound) {
+			reports.push_back(reportOf(method.first, STATS_INBOUND, *method.second));
+		}
+		for (auto &method : stats.outbound) {
+			reports.push_back(reportOf(method.first, STATS_OUTBOUND, *method.second));
+		}
+		return reports;
+	}
+
+private:
+	typedef std::map<std::string, std::unique_ptr<MethodStats>> MethodMap;
+
+	struct State {
+		std::mutex methodsLock; //Only taken the first time a handler is bound or a thread calls a method; entries are never removed
+		MethodMap inbound;
+		MethodMap outbound;
+	};
+
+	//Records how long the enclosing call took and keeps the in-flight count
+	struct Timer {
+		explicit Timer(MethodStats *stats) : stats(stats), start(std::chrono::steady_clock::now()) {
+			stats->inFlight++;
+		}
+		~Timer() {
+			stats->latency.record(elapsedMicros(start));
+			stats->inFlight--;
+		}
+		MethodStats *stats;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	template <typename R>
+	struct Invoker {
+		template <typename F, typename... Args>
+		static R run(MethodStats *stats, F handler, Args&&... args) {
+			R result = handler(std::forward<Args>(args)...);
+			stats->bytesOut += wireSize(result);
+			return result;
+		}
+	};
+
+	static State &state() {
+		static State instance;
+		return instance;
+	}
+
+	static MethodStats &lookup(MethodMap &methods, const std::string &method) {
+		std::lock_guard<std::mutex> guard(state().methodsLock);
+		std::unique_ptr<MethodStats> &entry = methods[method];
+		if (!entry) {
+			entry.reset(new MethodStats());
+		}
+		return *entry;
+	}
+
+	static MethodReport reportOf(const std::string &method, int direction, const MethodStats &stats) {
+		return MethodReport(method, direction, stats.calls, stats.inFlight, stats.bytesIn, stats.bytesOut, stats.latency.sparse());
+	}
+
+	template <typename... Args>
+	static long long argumentsSize(const Args&... args) {
+		long long sizes[] = { wireHeaderSize(sizeof...(Args), 16, false), wireSize(args)... };
+		long long total = 0;
+		for (long long size : sizes) {
+			total += size;
+		}
+		return total;
+	}
+
+	static long long elapsedMicros(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+//Handlers without a reply send back nil, one byte
+template <>
+struct Stats::Invoker<void> {
+	template <typename F, typename... Args>
+	static void run(MethodStats *stats, F handler, Args&&... args) {
+		handler(std::forward<Args>(args)...);
+		stats->bytesOut += 1;
+	}
+};
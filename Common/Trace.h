@@ -0,0 +1,116 @@
+#pragma once
+#include "FileId.h"
+#include "Log.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+//Opt-in query tracing, keyed by the {leafId, seq} message IDs queries already carry. Setting
+//GNUTELLA_TRACE=1 in the driver's environment turns it on for every process it spawns. Supers record
+//each query and queryHit they receive; leaves record when each of their queries was sent, answered and
+//downloaded. The driver fetches both through the trace RPC and rebuilds the flood tree of each query.
+
+#define TRACE_QUERY 0
+#define TRACE_HIT 1
+#define TRACE_CAPACITY 1000000
+
+typedef std::tuple<std::array<int, 2>, int, int, int, int, long long, bool, std::vector<int>> TraceEvent; // (messageId, kind, node, sender, TTL, arrival micros, duplicate, forwarded to)
+typedef std::tuple<std::array<int, 2>, long long, long long, long long, int> QueryTiming; // (messageId, sent, first hit, downloaded, hits received), times in micros or -1
+typedef std::tuple<std::vector<TraceEvent>, std::vector<QueryTiming>> TraceReport;
+
+class Trace {
+public:
+	static bool enabled() {
+		static const bool on = Log::env("GNUTELLA_TRACE") == "1";
+		return on;
+	}
+
+	//Wall clock, so arrivals recorded by different processes line up
+	static long long now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	static void record(TraceEvent event) {
+		State &trace = state();
+		trace.lock.lock();
+		if (trace.events.size() < TRACE_CAPACITY) {
+			trace.events.push_back(std::move(event));
+		}
+		else if (trace.dropped++ == 0) {
+			LOG_WARN("Trace buffer full, dropping further events");
+		}
+		trace.lock.unlock();
+	}
+
+	static void querySent(std::array<int, 2> messageId, FileId fileId) {
+		State &trace = state();
+		trace.lock.lock();
+		trace.timings[key(messageId)] = QueryTiming(messageId, now(), -1, -1, 0);
+		trace.requests[std::make_pair(messageId[0], fileId)] = key(messageId);
+		trace.lock.unlock();
+	}
+
+	static void hitReceived(std::array<int, 2> messageId) {
+		State &trace = state();
+		trace.lock.lock();
+		auto timing = trace.timings.find(key(messageId));
+		if (timing != trace.timings.end()) {
+			if (std::get<2>(timing->second) < 0) {
+				std::get<2>(timing->second) = now();
+			}
+			std::get<4>(timing->second)++;
+		}
+		trace.lock.unlock();
+	}
+
+	static void downloaded(int leafId, FileId fileId) {
+		State &trace = state();
+		trace.lock.lock();
+		auto request = trace.requests.find(std::make_pair(leafId, fileId));
+		if (request != trace.requests.end()) {
+			auto timing = trace.timings.find(request->second);
+			if (timing != trace.timings.end() && std::get<3>(timing->second) < 0) {
+				std::get<3>(timing->second) = now();
+			}
+		}
+		trace.lock.unlock();
+	}
+
+	//Handler for the trace RPC
+	static TraceReport report() {
+		State &trace = state();
+		TraceReport result;
+		trace.lock.lock();
+		std::get<0>(result) = trace.events;
+		for (auto &timing : trace.timings) {
+			std::get<1>(result).push_back(timing.second);
+		}
+		trace.lock.unlock();
+		return result;
+	}
+
+	static uint64_t key(std::array<int, 2> messageId) {
+		return (uint64_t(uint32_t(messageId[0])) << 32) | uint32_t(messageId[1]);
+	}
+
+private:
+	struct State {
+		State() : dropped(0) {}
+		std::mutex lock;
+		std::vector<TraceEvent> events;
+		std::unordered_map<uint64_t, QueryTiming> timings; // message key -> timing of a query sent from here
+		std::map<std::pair<int, FileId>, uint64_t> requests; // (leafId, fileId) -> message key of the query asking for it
+		long long dropped;
+	};
+
+	static State &state() {
+		static State instance;
+		return instance;
+	}
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+//Transport the driver, supers and leaves talk over. The default build uses rpclib over TCP; defining
+//GNUTELLA_SIMULATION switches to an in-memory transport so one process can run supers and leaves as
+//objects. The backend is picked at compile time, not behind a runtime interface. Both backends provide
+//the same names: Server, Client, Reply, RemoteError, TimeoutError, respondError, stopServer,
+//connectionLost, wireSize, runInBackground and runAfter.
+
+#ifdef GNUTELLA_SIMULATION
+#include "MemoryTransport.h"
+#else
+#include "rpc/server.h"
+#include "rpc/client.h"
+#include "rpc/rpc_error.h"
+#include "rpc/this_handler.h"
+#include "rpc/this_server.h"
+#include "JobPool.h"
+#include "WireSize.h"
+#include <chrono>
+#include <functional>
+#include <string>
+
+typedef rpc::server Server;
+typedef rpc::client Client;
+typedef RPCLIB_MSGPACK::object_handle Reply;
+typedef rpc::rpc_error RemoteError;
+typedef rpc::timeout TimeoutError;
+
+//Makes the running handler answer with an error instead of its return value
+inline void respondError(const std::string &message) {
+	rpc::this_handler().respond_error(message);
+}
+
+//Stops the server whose handler is running
+inline void stopServer() {
+	rpc::this_server().stop();
+}
+
+//Whether client's connection dropped and it needs replacing
+inline bool connectionLost(Client &client) {
+	rpc::client::connection_state state = client.get_connection_state();
+	return state == rpc::client::connection_state::disconnected || state == rpc::client::connection_state::reset;
+}
+
+//Encoded size of a reply, worked out from the object rpclib already decoded
+inline long long wireSize(const RPCLIB_MSGPACK::object &object) {
+	switch (object.type) {
+	case RPCLIB_MSGPACK::type::POSITIVE_INTEGER:
+		return wireSize(object.via.u64);
+	case RPCLIB_MSGPACK::type::NEGATIVE_INTEGER:
+		return wireSize(object.via.i64);
+	case RPCLIB_MSGPACK::type::FLOAT32:
+		return 5;
+	case RPCLIB_MSGPACK::type::FLOAT64:
+		return 9;
+	case RPCLIB_MSGPACK::type::STR:
+		return wireHeaderSize(object.via.str.size, 32, true) + object.via.str.size;
+	case RPCLIB_MSGPACK::type::BIN:
+		return wireHeaderSize(object.via.bin.size, 0, true) + object.via.bin.size;
+	case RPCLIB_MSGPACK::type::ARRAY: {
+		long long size = wireHeaderSize(object.via.array.size, 16, false);
+		for (uint32_t i = 0; i < object.via.array.size; i++) {
+			size += wireSize(object.via.array.ptr[i]);
+		}
+		return size;
+	}
+	case RPCLIB_MSGPACK::type::MAP: {
+		long long size = wireHeaderSize(object.via.map.size, 16, false);
+		for (uint32_t i = 0; i < object.via.map.size; i++) {
+			size += wireSize(object.via.map.ptr[i].key) + wireSize(object.via.map.ptr[i].val);
+		}
+		return size;
+	}
+	default:
+		//nil and booleans
+		return 1;
+	}
+}
+
+inline long long wireSize(const Reply &reply) {
+	return wireSize(reply.get());
+}
+
+//Runs a node job on the process's job pool
+inline void runInBackground(std::function<void()> job) {
+	JobPool::instance().run(std::move(job));
+}
+
+//Runs a node job on the process's job pool once delay has passed
+inline void runAfter(std::chrono::milliseconds delay, std::function<void()> job) {
+	JobPool::instance().after(delay, std::move(job));
+}
+#endif
@@ -0,0 +1,103 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//msgpack encoded size of the values nodes send each other, worked out from the values themselves so the
+//stats can count bytes without encoding anything a second time. Integers take their shortest form, byte
+//vectors go as bin, and every other container as an array, the way rpclib's msgpack packs them.
+
+inline long long wireHeaderSize(size_t length, size_t fixedLimit, bool hasByteForm) {
+	//Header of a string, bin, array or map: one byte up to fixedLimit items, then 8, 16 or 32 bit lengths
+	if (length < fixedLimit) {
+		return 1;
+	}
+	if (hasByteForm && length < 256) {
+		return 2;
+	}
+	return length < 65536 ? 3 : 5;
+}
+
+inline long long wireSize(bool) {
+	return 1;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, long long>::type wireSize(T value) {
+	uint64_t bits = uint64_t(value);
+	return bits < 128 ? 1 : bits < 256 ? 2 : bits < 65536 ? 3 : bits < 4294967296ULL ? 5 : 9;
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, long long>::type wireSize(T value) {
+	int64_t number = int64_t(value);
+	if (number >= 0) {
+		return wireSize(uint64_t(number));
+	}
+	return number >= -32 ? 1 : number >= -128 ? 2 : number >= -32768 ? 3 : number >= -2147483648LL ? 5 : 9;
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, long long>::type wireSize(T) {
+	return sizeof(T) == 4 ? 5 : 9;
+}
+
+inline long long wireSize(const std::string &value) {
+	return wireHeaderSize(value.size(), 32, true) + (long long)value.size();
+}
+
+inline long long wireSize(const std::vector<uint8_t> &bytes) {
+	return wireHeaderSize(bytes.size(), 0, true) + (long long)bytes.size();
+}
+
+template <typename T>
+long long wireSize(const std::vector<T> &values);
+template <typename T, size_t N>
+long long wireSize(const std::array<T, N> &values);
+template <typename A, typename B>
+long long wireSize(const std::pair<A, B> &value);
+template <typename... T>
+long long wireSize(const std::tuple<T...> &value);
+
+template <typename T>
+long long wireSize(const std::vector<T> &values) {
+	long long size = wireHeaderSize(values.size(), 16, false);
+	for (auto &value : values) {
+		size += wireSize(value);
+	}
+	return size;
+}
+
+template <typename T, size_t N>
+long long wireSize(const std::array<T, N> &values) {
+	long long size = wireHeaderSize(N, 16, false);
+	for (auto &value : values) {
+		size += wireSize(value);
+	}
+	return size;
+}
+
+template <typename A, typename B>
+long long wireSize(const std::pair<A, B> &value) {
+	return 1 + wireSize(value.first) + wireSize(value.second);
+}
+
+template <typename Tuple, size_t... I>
+long long tupleWireSize(const Tuple &value, std::index_sequence<I...>) {
+	long long sizes[] = { wireHeaderSize(sizeof...(I), 16, false), wireSize(std::get<I>(value))... };
+	long long total = 0;
+	for (long long size : sizes) {
+		total += size;
+	}
+	return total;
+}
+
+template <typename... T>
+long long wireSize(const std::tuple<T...> &value) {
+	return tupleWireSize(value, std::index_sequence_for<T...>());
+}
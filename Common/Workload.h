@@ -0,0 +1,233 @@
+#pragma once
+#include "FileId.h"
+#include "Log.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//Synthetic workload shared by the driver and leaves. GNUTELLA_WORKLOAD holds space-separated settings
+//which, like the log settings, the driver passes on to every process it spawns:
+//	popularity=uniform | zipf:<exponent> | hotspot:<fraction of files>:<fraction of requests>
+//	size=position | fixed:<bytes> | uniform:<min>:<max> | lognormal:<median>:<sigma> | pareto:<min>:<alpha>
+//	arrival=closed | poisson:<queries per second> | rate:<queries per second>
+//	seed=<n>
+//Byte counts take K, M and G suffixes and are clamped to WORKLOAD_MIN_SIZE..WORKLOAD_MAX_SIZE. Arrival
+//rates are per leaf. Anything unset keeps the original workload: uniform requests, files sized by their
+//position on the leaf's command line, and every query sent as soon as the leaf starts.
+
+#define WORKLOAD_MIN_SIZE 1024LL
+#define WORKLOAD_MAX_SIZE (1024LL * 1024 * 1024)
+#define WORKLOAD_CONTENT_BLOCK (64 * 1024)
+
+#define POPULARITY_UNIFORM 0
+#define POPULARITY_ZIPF 1
+#define POPULARITY_HOTSPOT 2
+
+#define SIZE_POSITION 0
+#define SIZE_FIXED 1
+#define SIZE_UNIFORM 2
+#define SIZE_LOGNORMAL 3
+#define SIZE_PARETO 4
+
+#define ARRIVAL_CLOSED 0
+#define ARRIVAL_POISSON 1
+#define ARRIVAL_RATE 2
+
+class Workload {
+public:
+	//Draws file ranks 0 to n - 1, rank 0 being the most popular
+	class Popularity {
+	public:
+		Popularity(const Workload &workload, int n) : kind(workload.popularity), n(n), hotFiles(1) {
+			if (kind == POPULARITY_ZIPF && n > 0) {
+				//Inverse CDF lookup: one double per file
+				cdf.resize(n);
+				double total = 0;
+				for (int rank = 0; rank < n; rank++) {
+					total += 1.0 / std::pow(rank + 1.0, workload.popularityShape);
+					cdf[rank] = total;
+				}
+				for (double &p : cdf) {
+					p /= total;
+				}
+			}
+			else if (kind == POPULARITY_HOTSPOT) {
+				hotFiles = std::max(1, std::min(n, int(std::ceil(n * workload.popularityShape))));
+				hotShare = workload.popularityShare;
+			}
+		}
+
+		int sample(std::mt19937 &random) const {
+			if (n <= 0) {
+				return 0;
+			}
+			std::uniform_real_distribution<double> unit(0, 1);
+			if (kind == POPULARITY_ZIPF) {
+				int rank = int(std::lower_bound(cdf.begin(), cdf.end(), unit(random)) - cdf.begin());
+				return std::min(rank, n - 1);
+			}
+			if (kind == POPULARITY_HOTSPOT && hotFiles < n) {
+				if (unit(random) < hotShare) {
+					return std::uniform_int_distribution<int>(0, hotFiles - 1)(random);
+				}
+				return std::uniform_int_distribution<int>(hotFiles, n - 1)(random);
+			}
+			return std::uniform_int_distribution<int>(0, n - 1)(random);
+		}
+
+	private:
+		int kind;
+		int n;
+		std::vector<double> cdf;
+		int hotFiles;
+		double hotShare = 0;
+	};
+
+	static const Workload &current() {
+		static const Workload workload(Log::env("GNUTELLA_WORKLOAD"));
+		return workload;
+	}
+
+	explicit Workload(const std::string &settings) : popularity(POPULARITY_UNIFORM), popularityShape(0), popularityShare(0),
+		size(SIZE_POSITION), sizeA(0), sizeB(0), arrival(ARRIVAL_CLOSED), rate(0), seed(0) {
+		std::istringstream stream(settings);
+		std::string setting;
+		while (stream >> setting) {
+			size_t equals = setting.find('=');
+			std::string name = setting.substr(0, equals);
+			std::vector<std::string> fields = split(equals == std::string::npos ? "" : setting.substr(equals + 1));
+			if (name == "popularity" && !fields.empty()) {
+				if (fields[0] == "zipf" && fields.size() > 1) {
+					popularity = POPULARITY_ZIPF;
+					popularityShape = std::stod(fields[1]);
+				}
+				else if (fields[0] == "hotspot" && fields.size() > 2) {
+					popularity = POPULARITY_HOTSPOT;
+					popularityShape = std::stod(fields[1]);
+					popularityShare = std::stod(fields[2]);
+				}
+			}
+			else if (name == "size" && !fields.empty()) {
+				if (fields[0] == "fixed" && fields.size() > 1) {
+					size = SIZE_FIXED;
+					sizeA = bytesOf(fields[1]);
+				}
+				else if (fields[0] == "uniform" && fields.size() > 2) {
+					size = SIZE_UNIFORM;
+					sizeA = bytesOf(fields[1]);
+					sizeB = bytesOf(fields[2]);
+				}
+				else if (fields[0] == "lognormal" && fields.size() > 2) {
+					size = SIZE_LOGNORMAL;
+					sizeA = bytesOf(fields[1]);
+					sizeB = std::stod(fields[2]);
+				}
+				else if (fields[0] == "pareto" && fields.size() > 2) {
+					size = SIZE_PARETO;
+					sizeA = bytesOf(fields[1]);
+					sizeB = std::stod(fields[2]);
+				}
+			}
+			else if (name == "arrival" && !fields.empty()) {
+				if ((fields[0] == "poisson" || fields[0] == "rate") && fields.size() > 1 && std::stod(fields[1]) > 0) {
+					arrival = fields[0] == "poisson" ? ARRIVAL_POISSON : ARRIVAL_RATE;
+					rate = std::stod(fields[1]);
+				}
+			}
+			else if (name == "seed" && !fields.empty()) {
+				seed = (unsigned int)std::stoul(fields[0]);
+			}
+			else {
+				LOG_WARN("Ignoring workload setting " << setting);
+			}
+		}
+	}
+
+	//Size of a file. Every node derives the same size from the file's name, so nothing extra is sent
+	long long fileSize(const std::string &fileName, long long positionSize) const {
+		if (size == SIZE_POSITION) {
+			return positionSize;
+		}
+		std::mt19937_64 random(fileIdOf(fileName) ^ seed);
+		double bytes = sizeA;
+		if (size == SIZE_UNIFORM) {
+			bytes = std::uniform_real_distribution<double>(sizeA, std::max(sizeA, sizeB))(random);
+		}
+		else if (size == SIZE_LOGNORMAL) {
+			bytes = sizeA * std::exp(sizeB * std::normal_distribution<double>(0, 1)(random));
+		}
+		else if (size == SIZE_PARETO) {
+			bytes = sizeA / std::pow(1 - std::uniform_real_distribution<double>(0, 1)(random), 1 / sizeB);
+		}
+		return std::max(WORKLOAD_MIN_SIZE, std::min(WORKLOAD_MAX_SIZE, (long long)bytes));
+	}
+
+	bool openLoop() const {
+		return arrival != ARRIVAL_CLOSED;
+	}
+
+	//Time from one query to the next for open-loop arrivals
+	std::chrono::microseconds nextArrival(std::mt19937 &random) const {
+		double seconds = arrival == ARRIVAL_POISSON ? std::exponential_distribution<double>(rate)(random) : 1 / rate;
+		return std::chrono::microseconds((long long)(seconds * 1e6));
+	}
+
+	//Writes bytes of printable filler in WORKLOAD_CONTENT_BLOCK blocks, so large files stay quick to make
+	static void writeContent(std::ostream &out, long long bytes, uint64_t seed) {
+		std::vector<char> block(WORKLOAD_CONTENT_BLOCK);
+		uint64_t state = seed | 1;
+		while (bytes > 0) {
+			size_t length = (size_t)std::min<long long>(bytes, WORKLOAD_CONTENT_BLOCK);
+			for (size_t i = 0; i < length; i += 8) {
+				//xorshift64, eight characters per step
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				uint64_t word = state;
+				for (size_t j = i; j < i + 8 && j < length; j++) {
+					block[j] = char(32 + (word & 0xff) % 95);
+					word >>= 8;
+				}
+			}
+			out.write(block.data(), length);
+			bytes -= length;
+		}
+	}
+
+	int popularity;
+	double popularityShape; // zipf exponent, or the fraction of files that are hot
+	double popularityShare; // fraction of requests that go to hot files
+	int size;
+	double sizeA, sizeB;
+	int arrival;
+	double rate;
+	unsigned int seed;
+
+private:
+	static std::vector<std::string> split(const std::string &text) {
+		std::vector<std::string> fields;
+		std::stringstream stream(text);
+		std::string field;
+		while (std::getline(stream, field, ':')) {
+			fields.push_back(field);
+		}
+		return fields;
+	}
+
+	static double bytesOf(const std::string &text) {
+		double value = std::stod(text);
+		switch (text.empty() ? ' ' : text.back()) {
+		case 'K': case 'k': return value * 1024;
+		case 'M': case 'm': return value * 1024 * 1024;
+		case 'G': case 'g': return value * 1024 * 1024 * 1024;
+		default: return value;
+		}
+	}
+};
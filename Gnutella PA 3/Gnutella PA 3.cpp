@@ -1,8 +1,10 @@
-#include "rpc/server.h"
-#include "rpc/client.h"
-#include "rpc/rpc_error.h"
+#include "../Common/Transport.h"
+#ifndef GNUTELLA_SIMULATION
 #include <direct.h>
 #include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
 #include <iostream>
 #include <chrono>
 #include <ctime>
@@ -13,24 +15,69 @@
 #include <numeric>
 #include <mutex>
 #include <condition_variable>
+#include <map>
+#include <unordered_map>
+#include <fstream>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <iterator>
+#include <thread>
+#include <set>
+#include <queue>
+#include "../Common/Bootstrap.h"
+#include "../Common/Log.h"
+#include "../Common/Stats.h"
+#include "../Common/Trace.h"
+#include "../Common/Workload.h"
 
 #define ALL_TO_ALL 0
 #define LINEAR 1
+#define RANDOM_REGULAR 2
+#define SMALL_WORLD 3
+#define TREE 4
+#define HYPERCUBE 5
+
+#define DEFAULT_DEGREE 4
+#define SMALL_WORLD_REWIRE 0.1
+#define TOPOLOGY_DIRECTORY "Topology"
+#define REQUEST_DRAW_ATTEMPTS 64
+#define METRICS_WAIT_MS 30000
 
 void superReady();
 void leafComplete();
-void metrics(int valid, int invalid);
+void metrics(int valid, int invalid, int failed);
+#ifdef GNUTELLA_SIMULATION
+typedef int (*NodeEntry)(int argc, char* argv[]);
+int runSuperPeer(int argc, char* argv[]);
+int runLeaf(int argc, char* argv[]);
+void run(NodeEntry entry, std::string args);
+#else
 void copyAppend(char *source, char *destination, int destSize, std::string extra);
 void run(LPCSTR name, std::string args);
+#endif
+void collectStats(int nextId, std::map<std::string, double> &results);
+void collectTraces(int nextId, std::map<std::string, double> &results);
+void writeResults(const std::string &path, const std::map<std::string, double> &results);
+std::vector<std::set<int>> buildTopology(int n, std::mt19937 &random);
+void connectComponents(std::vector<std::set<int>> &graph);
+int diameterOf(const std::vector<std::set<int>> &graph);
+int eccentricity(const std::vector<std::set<int>> &graph, int start, int &distance);
+std::string writeNeighbors(int id, const std::set<int> &neighbors);
+void makeDirectory(const std::string &path);
+void writeTree(std::ofstream &out, const std::vector<TraceEvent> &events, int node, long long sent, int depth, std::unordered_set<int> &visited);
+double percentileOf(std::vector<double> values, double q);
 
 int nSupers = 5, leavesPerSuper = 3, filesPerLeaf = 20, requestsPerLeaf = 10, topology = ALL_TO_ALL, TTL, duplicationFactor = 2, extraLeaves = 1, extraRequests = 200;
-int mode = 4; //0 none, 1 push, 2 pull1, 3 push&pull1, 4 pull2
-int valid = 0, invalid = 0;
+int degree = DEFAULT_DEGREE; //Neighbors per super in the random and small-world topologies, children per super in the tree
+const char *topologyNames[] = { "all-to-all", "linear", "random regular", "small world", "tree", "hypercube" };
+int mode = 4; //0 none, 1 push, 2 pull1, 3 push&pull1, 4 pull2, 5 lease
+unsigned int seed = 0; //0 seeds from the clock
+std::string resultsPath; //Empty unless a benchmark run asked for machine-readable results
+int valid = 0, invalid = 0, failedQueries = 0;
 
-int readyCount = 0, completeCount = 0;
-std::mutex countLock;
+Barrier supersReady, leavesComplete, metricsReported;
 std::mutex metricLock;
-std::condition_variable allReady;
 
 int main(int argc, char* argv[]) {
 	//Parse args to decide topology, nSupers, leavesPerSuper
@@ -45,18 +92,44 @@ int main(int argc, char* argv[]) {
 		extraRequests = std::stoi(argv[8]);
 		mode = std::stoi(argv[9]);
 	}
-	if (topology == ALL_TO_ALL) {
-		TTL = 3;
+	//Optional: TTL (0 picks one from the topology), seed for the workload, results file, degree
+	if (argc > 10) {
+		TTL = std::stoi(argv[10]);
+	}
+	if (argc > 11) {
+		seed = (unsigned int)std::stoul(argv[11]);
+	}
+	if (argc > 12) {
+		resultsPath = argv[12];
 	}
-	else {
-		TTL = nSupers;
+	if (argc > 13) {
+		degree = std::max(1, std::stoi(argv[13]));
 	}
+	Log::start("driver");
+	if (topology < ALL_TO_ALL || topology > HYPERCUBE) {
+		LOG_ERROR("Unknown topology " << topology);
+		Log::shutdown();
+		return 1;
+	}
+	//The overlay has its own generator so the same seed gives the same workload on every topology
+	std::mt19937 overlay(seed != 0 ? seed : (unsigned int)std::time(nullptr));
+	std::vector<std::set<int>> graph = buildTopology(nSupers, overlay);
+	if (TTL <= 0) {
+		//Enough hops for a query to reach every super. All-to-all keeps its historical TTL of 3
+		TTL = topology == ALL_TO_ALL ? 3 : diameterOf(graph) + 1;
+	}
+	LOG_INFO("Topology " << topologyNames[topology] << " with TTL " << TTL);
 	//Create server to listen for ready and complete signals
-	rpc::server server(8000);
+	Server server(8000);
 	server.bind("ready", &superReady);
 	server.bind("complete", &leafComplete);
 	server.bind("metrics", &metrics);
 	server.async_run(1);
+#ifdef GNUTELLA_SIMULATION
+	//Supers and leaves run as threads of this process
+	NodeEntry superPath = &runSuperPeer;
+	NodeEntry leafPath = &runLeaf;
+#else
 	//Get path to super and leaf executables
 	char currentPath[MAX_PATH];
 	_getcwd(currentPath, MAX_PATH);
@@ -64,36 +137,26 @@ int main(int argc, char* argv[]) {
 	char leafPath[MAX_PATH];
 	copyAppend(currentPath, superPath, MAX_PATH, "\\SuperPeer.exe");
 	copyAppend(currentPath, leafPath, MAX_PATH, "\\Leaf.exe");
-	//Spawn supers: ID, nSupers, leavesPerSuper, TTL, mode, [neighbors...]
-	std::cout << "Spawning Supers" << std::endl;
+#endif
+	//Spawn supers: ID, nSupers, leavesPerSuper, TTL, mode, @file listing the neighbors. The file keeps
+	//large neighbor lists clear of the command line limit
+	LOG_INFO("Spawning Supers");
+	auto spawnTime = std::chrono::high_resolution_clock::now();
+	makeDirectory(TOPOLOGY_DIRECTORY);
 	int nextId = 1;
 	for (int i = 0; i < nSupers; i++) {
 		int id = nextId++;
 		std::string args = std::to_string(id) + " " + std::to_string(nSupers) + " " + std::to_string(leavesPerSuper) + " " + std::to_string(TTL) + " " + std::to_string(mode);
-		if (topology == ALL_TO_ALL) {
-			for (int neighborId = 1; neighborId <= nSupers; neighborId++) {
-				if (neighborId != id) {
-					args += " " + std::to_string(neighborId);
-				}
-			}
-		}
-		else if (topology == LINEAR) {
-			if (id > 1) {
-				args += " " + std::to_string(id - 1);
-			}
-			if (id < nSupers) {
-				args += " " + std::to_string(id + 1);
-			}
-		}
+		args += " @" + writeNeighbors(id, graph[i]);
 		run(superPath, args);
-		//std::cout << "Super args: " << args << std::endl;
 	}
 	//Spawn leaves: ID, superID, nSupers, TTL, mode, isExtra, [initial files...], "requests", [requests...]
-	std::cout << "Spawning Leaves" << std::endl;
+	LOG_INFO("Spawning Leaves");
 	std::vector<std::unordered_set<int>> initialFiles;
 	std::unordered_set<int> used;
-	//Choose random initial files
-	std::srand(unsigned int(std::time(nullptr)));
+	//Choose random initial files. The workload has its own generator: leaves reseed std::rand, and in the
+	//simulation build they share it with us
+	std::mt19937 workload(seed != 0 ? seed : (unsigned int)std::time(nullptr));
 	//std::vector<int> numbers(nSupers * leavesPerSuper * filesPerLeaf / duplicationFactor);
 	//std::iota(numbers.begin(), numbers.end(), 1);
 	//for (int i = 0; i < nSupers * leavesPerSuper; i++) {
@@ -112,10 +175,29 @@ int main(int argc, char* argv[]) {
 		for (int j = 0; j < filesPerLeaf; j++) {
 			files.insert(i * filesPerLeaf + j);
 			used.insert(i * filesPerLeaf + j);
-			//std::cout << i * filesPerLeaf << " " << j << std::endl;
 		}
 	}
 	std::vector<int> usedVector(used.begin(), used.end());
+	//Requests follow the workload's popularity over a random ranking of the files
+	std::vector<int> byPopularity = usedVector;
+	std::sort(byPopularity.begin(), byPopularity.end());
+	std::shuffle(byPopularity.begin(), byPopularity.end(), workload);
+	Workload::Popularity popularity(Workload::current(), int(byPopularity.size()));
+	auto drawRequest = [&](const std::unordered_set<int> &own, const std::unordered_set<int> &taken) {
+		for (int attempt = 0; attempt < REQUEST_DRAW_ATTEMPTS; attempt++) {
+			int candidate = byPopularity[popularity.sample(workload)];
+			if (own.find(candidate) == own.end() && taken.find(candidate) == taken.end()) {
+				return candidate;
+			}
+		}
+		//Heavy skew can leave only unpopular files; take the most popular one still free
+		for (int candidate : byPopularity) {
+			if (own.find(candidate) == own.end() && taken.find(candidate) == taken.end()) {
+				return candidate;
+			}
+		}
+		return -1;
+	};
 	int totalRequests = 0;
 	for (int i = 0; i < nSupers * leavesPerSuper; i++) {
 		//Choose random requests
@@ -129,11 +211,7 @@ int main(int argc, char* argv[]) {
 		numRequests = std::min(requestsPerLeaf, numRequests);
 		totalRequests += numRequests;
 		for (int j = 0; j < numRequests; j++) {
-			int requestNum;
-			do {
-				requestNum = usedVector[std::rand() % usedVector.size()];
-			} while (requestFiles.find(requestNum) != requestFiles.end() || initialFiles[i].find(requestNum) != initialFiles[i].end());
-			requestFiles.insert(requestNum);
+			requestFiles.insert(drawRequest(initialFiles[i], requestFiles));
 		}
 		//Build args and spawn leaf
 		std::string args = std::to_string(nextId++) + " " + std::to_string(i % nSupers + 1) + " " + std::to_string(nSupers) + " " + std::to_string(TTL) + " 0 " + std::to_string(mode);
@@ -145,100 +223,476 @@ int main(int argc, char* argv[]) {
 			args += " " + std::to_string(request) + ".txt";
 		}
 		run(leafPath, args);
-		//std::cout << "Leaf args: " << args << std::endl;
 	}
 	//Wait for all supers to give ready signal
-	std::unique_lock<std::mutex> unique(countLock);
-	allReady.wait(unique, [] { return readyCount >= nSupers; });
-	std::cout << "Supers are ready" << std::endl;
+	supersReady.wait(nSupers);
+	std::chrono::duration<double> startup = std::chrono::high_resolution_clock::now() - spawnTime;
+	LOG_INFO("Supers are ready after " << startup.count() << " seconds");
 	//Start timer
 	auto startTime = std::chrono::high_resolution_clock::now();
-	//Tell leaves to begin making requests
-	std::cout << "Starting Leaf requests" << std::endl;
-	for (int i = nSupers + 1; i < nextId; i++) {
-		rpc::client sysClient("localhost", 8000 + i);
-		sysClient.call("start");
+	//Tell leaves to begin making requests: the first leaf passes the start on down a tree of the others
+	LOG_INFO("Starting Leaf requests");
+	if (nextId > nSupers + 1) {
+		Client sysClient("localhost", 8000 + nSupers + 1);
+		sysClient.call("startAll", nextId);
 	}
 	//Wait for all leaves to give complete signal
-	allReady.wait(unique, [] { return completeCount >= nSupers * leavesPerSuper; });
-	std::cout << "Leaves have finished" << std::endl;
+	leavesComplete.wait(nSupers * leavesPerSuper);
+	LOG_INFO("Leaves have finished");
 	//End timer
 	std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - startTime;
-	std::cout << totalRequests << " requests took " << duration.count() << " seconds. R/s = " << std::to_string(totalRequests / duration.count()) << std::endl;
+	LOG_INFO(totalRequests << " requests took " << duration.count() << " seconds. R/s = " << std::to_string(totalRequests / duration.count()));
+	std::map<std::string, double> results;
+	results["requests"] = totalRequests;
+	results["seconds"] = duration.count();
+	results["throughput"] = totalRequests / duration.count();
+	results["startupSeconds"] = startup.count();
 	//Wait a little bit so some files get updated
 	std::this_thread::sleep_for(std::chrono::milliseconds(5000));
 	//Create extra leaves that will run while others are doing file modifications
-	std::cout << "Spawning extra leaves" << std::endl;
+	LOG_INFO("Spawning extra leaves");
+	std::vector<int> extraIds;
 	for (int i = 0; i < extraLeaves; i++) {
-		std::vector<int> uniqueNumbers(nSupers * leavesPerSuper * filesPerLeaf);
-		std::iota(uniqueNumbers.begin(), uniqueNumbers.end(), 0);
 		int leafId = nextId++;
 		std::string args = std::to_string(leafId) + " 1 " + std::to_string(nSupers) + " " + std::to_string(TTL) + " 1 " + std::to_string(mode) + " requests";
-		std::random_shuffle(uniqueNumbers.begin(), uniqueNumbers.end());
-		for (int j = 0; j < std::min(extraRequests, nSupers * leavesPerSuper * filesPerLeaf); j++) {
-			args += " " + std::to_string(uniqueNumbers[j]) + ".txt";
+		std::unordered_set<int> requestFiles;
+		for (int j = 0; j < std::min(extraRequests, int(byPopularity.size())); j++) {
+			int requestNum = drawRequest({}, requestFiles);
+			requestFiles.insert(requestNum);
+			args += " " + std::to_string(requestNum) + ".txt";
 		}
 		run(leafPath, args);
-		rpc::client *leafClient = new rpc::client("localhost", 8000 + leafId);
-		leafClient->set_timeout(1000);
-		while (true) {
-			try {
-				leafClient->call("start");
-				break;
-			}
-			catch (rpc::timeout &t) {
-				//Ping timed out, try restarting client
-				delete leafClient;
-				leafClient = new rpc::client("localhost", 8000 + leafId);
-				leafClient->set_timeout(1000);
-				t; //Silence warning
-			}
-		}
-		delete leafClient;
+		extraIds.push_back(leafId);
+	}
+	//Start each one as soon as it's listening
+	Bootstrap::connectAll(extraIds, "start");
+	leavesComplete.wait(nSupers * leavesPerSuper + extraLeaves);
+	LOG_INFO("Extra leaves have finished");
+	collectStats(nextId, results);
+	if (Trace::enabled()) {
+		collectTraces(nextId, results);
 	}
-	allReady.wait(unique, [] { return completeCount >= nSupers * leavesPerSuper + extraLeaves; });
-	std::cout << "Extra leaves have finished" << std::endl;
 	//Send end signal to all supers and leaves
-	std::vector<rpc::client*> clients;
+	std::vector<Client*> clients;
 	for (int i = 1; i < nextId; i++) {
-		rpc::client *client = new rpc::client("localhost", 8000 + i);
+		Client *client = new Client("localhost", 8000 + i);
 		clients.push_back(client);
 		client->async_call("end");
 	}
+	//Leaves report their metrics once they've stopped updating files
+	int nLeaves = nSupers * leavesPerSuper + extraLeaves;
+	if (!metricsReported.waitFor(nLeaves, METRICS_WAIT_MS)) {
+		LOG_WARN("Only " << metricsReported.arrivals() << " of " << nLeaves << " leaves reported metrics");
+	}
 	//Calculate invalid metrics
 	metricLock.lock();
 	double percent = (double)invalid / (valid + invalid) * 100;
-	std::cout << "Valid: " << valid << "\tInvalid: " << invalid << "\tInvalid percent: " << std::setprecision(5) << percent << "%" << std::endl;
+	LOG_INFO("Valid: " << valid << "\tInvalid: " << invalid << "\tInvalid percent: " << std::setprecision(5) << percent << "%");
+	results["valid"] = valid;
+	results["invalid"] = invalid;
+	results["invalidRate"] = valid + invalid == 0 ? 0 : (double)invalid / (valid + invalid);
+	if (failedQueries > 0) {
+		LOG_WARN(failedQueries << " queries timed out without finding their file");
+	}
+	results["failedQueries"] = failedQueries;
 	metricLock.unlock();
-	//Wait for end
-	std::cout << "Press Enter to exit" << std::endl;
-	std::cin.get();
+	if (!resultsPath.empty()) {
+		writeResults(resultsPath, results);
+	}
+#ifdef GNUTELLA_SIMULATION
+	//Node threads never return, so leave without running static destructors under them
+	Log::shutdown();
+	std::_Exit(0);
+#else
+	//Wait for end, unless a benchmark run is waiting on us
+	if (resultsPath.empty()) {
+		LOG_INFO("Press Enter to exit");
+		Log::flush();
+		std::cin.get();
+	}
 	for (auto client : clients) {
 		delete client;
 	}
+	Log::shutdown();
+#endif
 }
 
 void superReady() {
-	countLock.lock();
-	readyCount++;
-	countLock.unlock();
-	allReady.notify_one();
+	supersReady.arrive();
 }
 
 void leafComplete() {
-	countLock.lock();
-	completeCount++;
-	countLock.unlock();
-	allReady.notify_one();
+	leavesComplete.arrive();
 }
 
-void metrics(int validIn, int invalidIn) {
+void metrics(int validIn, int invalidIn, int failedIn) {
 	metricLock.lock();
 	valid += validIn;
 	invalid += invalidIn;
+	failedQueries += failedIn;
 	metricLock.unlock();
+	metricsReported.arrive();
+}
+
+void collectStats(int nextId, std::map<std::string, double> &results) {
+	//Merges every node's per-method counters and latency histograms by role, direction and method
+	struct Totals {
+		long long calls = 0, inFlight = 0, bytesIn = 0, bytesOut = 0;
+		std::map<int, long long> latency;
+	};
+	std::map<std::tuple<std::string, int, std::string>, Totals> totals;
+#ifdef GNUTELLA_SIMULATION
+	//Every node shares this process's counters, so the first one reports for all of them
+	nextId = std::min(nextId, 2);
+#endif
+	for (int i = 1; i < nextId; i++) {
+#ifdef GNUTELLA_SIMULATION
+		std::string role = "all";
+#else
+		std::string role = i <= nSupers ? "super" : "leaf";
+#endif
+		std::vector<MethodReport> reports;
+		try {
+			Client client("localhost", 8000 + i);
+			client.set_timeout(5000);
+			reports = client.call("stats").as<std::vector<MethodReport>>();
+		}
+		catch (std::exception &e) {
+			LOG_WARN("Couldn't collect stats from " << i << ": " << e.what());
+		}
+		for (auto &report : reports) {
+			Totals &total = totals[std::make_tuple(role, std::get<1>(report), std::get<0>(report))];
+			total.calls += std::get<2>(report);
+			total.inFlight += std::get<3>(report);
+			total.bytesIn += std::get<4>(report);
+			total.bytesOut += std::get<5>(report);
+			for (auto &bucket : std::get<6>(report)) {
+				total.latency[bucket.first] += bucket.second;
+			}
+		}
+	}
+	LOG_INFO("role\tdirection\tmethod\tcalls\tin flight\tbytes in\tbytes out\tp50 us\tp99 us\tp999 us");
+	for (auto &entry : totals) {
+		Totals &total = entry.second;
+		//Every message is counted once, by the handler that received it
+		if (std::get<1>(entry.first) == STATS_INBOUND) {
+			results["messages"] += total.calls;
+			results["bytes"] += total.bytesIn;
+		}
+		LOG_INFO(std::get<0>(entry.first) << "\t" << (std::get<1>(entry.first) == STATS_INBOUND ? "handler" : "outbound") << "\t" << std::get<2>(entry.first)
+			<< "\t" << total.calls << "\t" << total.inFlight << "\t" << total.bytesIn << "\t" << total.bytesOut
+			<< "\t" << LatencyHistogram::percentile(total.latency, 0.5) << "\t" << LatencyHistogram::percentile(total.latency, 0.99) << "\t" << LatencyHistogram::percentile(total.latency, 0.999));
+	}
+}
+
+void collectTraces(int nextId, std::map<std::string, double> &results) {
+	//Rebuilds the flood tree of every traced query into traces.txt and summarizes what the queries cost
+	std::unordered_map<uint64_t, std::vector<TraceEvent>> events; // message key -> events recorded by supers
+	std::vector<QueryTiming> timings;
+#ifdef GNUTELLA_SIMULATION
+	//Every node shares this process's trace buffer, so the first one reports for all of them
+	nextId = std::min(nextId, 2);
+#endif
+	for (int i = 1; i < nextId; i++) {
+		try {
+			Client client("localhost", 8000 + i);
+			client.set_timeout(5000);
+			TraceReport report = client.call("trace").as<TraceReport>();
+			for (auto &event : std::get<0>(report)) {
+				events[Trace::key(std::get<0>(event))].push_back(event);
+			}
+			timings.insert(timings.end(), std::get<1>(report).begin(), std::get<1>(report).end());
+		}
+		catch (std::exception &e) {
+			LOG_WARN("Couldn't collect trace from " << i << ": " << e.what());
+		}
+	}
+	std::ofstream out("traces.txt");
+	std::vector<double> searchMs, downloadMs;
+	long long queryMessages = 0, hitMessages = 0, duplicates = 0;
+	for (auto &timing : timings) {
+		const std::array<int, 2> &messageId = std::get<0>(timing);
+		const std::vector<TraceEvent> &queryEvents = events[Trace::key(messageId)];
+		long long sent = std::get<1>(timing), firstHit = std::get<2>(timing), downloaded = std::get<3>(timing);
+		if (firstHit >= 0) {
+			searchMs.push_back((firstHit - sent) / 1000.0);
+			if (downloaded >= 0) {
+				downloadMs.push_back((downloaded - firstHit) / 1000.0);
+			}
+		}
+		long long queries = 0, hits = std::get<4>(timing), duplicated = 0;
+		for (auto &event : queryEvents) {
+			if (std::get<1>(event) == TRACE_QUERY) {
+				queries++;
+				duplicated += std::get<6>(event);
+			}
+			else {
+				hits++;
+			}
+		}
+		queryMessages += queries;
+		hitMessages += hits;
+		duplicates += duplicated;
+		out << "query {" << messageId[0] << ", " << messageId[1] << "}: " << queries << " query messages (" << duplicated << " duplicates), " << hits << " hit messages";
+		if (firstHit >= 0) {
+			out << ", search " << (firstHit - sent) / 1000.0 << " ms";
+		}
+		if (firstHit >= 0 && downloaded >= 0) {
+			out << ", download " << (downloaded - firstHit) / 1000.0 << " ms";
+		}
+		out << std::endl << "  leaf " << messageId[0] << std::endl;
+		std::unordered_set<int> visited = { messageId[0] };
+		writeTree(out, queryEvents, messageId[0], sent, 2, visited);
+	}
+	std::string topologyName = topologyNames[topology];
+	double perQuery = timings.empty() ? 0 : 1.0 / timings.size();
+	LOG_INFO("Traced " << timings.size() << " queries over the " << topologyName << " topology, trees written to traces.txt");
+	LOG_INFO("Search latency ms: p50 " << percentileOf(searchMs, 0.5) << " p99 " << percentileOf(searchMs, 0.99) << " (" << searchMs.size() << " answered)");
+	LOG_INFO("Download latency ms: p50 " << percentileOf(downloadMs, 0.5) << " p99 " << percentileOf(downloadMs, 0.99));
+	LOG_INFO("Messages per query: " << (queryMessages + hitMessages) * perQuery << " (" << queryMessages * perQuery << " query, " << hitMessages * perQuery << " hit)");
+	LOG_INFO("Duplicate ratio: " << (queryMessages == 0 ? 0 : (double)duplicates / queryMessages));
+	results["searchP50Ms"] = percentileOf(searchMs, 0.5);
+	results["searchP99Ms"] = percentileOf(searchMs, 0.99);
+	results["searchP999Ms"] = percentileOf(searchMs, 0.999);
+	results["downloadP50Ms"] = percentileOf(downloadMs, 0.5);
+	results["downloadP99Ms"] = percentileOf(downloadMs, 0.99);
+	results["messagesPerQuery"] = (queryMessages + hitMessages) * perQuery;
+	results["duplicateRatio"] = queryMessages == 0 ? 0 : (double)duplicates / queryMessages;
+}
+
+void writeResults(const std::string &path, const std::map<std::string, double> &results) {
+	//One "name value" line per metric, read back by the benchmark sweep
+	std::ofstream out(path);
+	out << std::setprecision(10);
+	for (auto &result : results) {
+		out << result.first << " " << result.second << std::endl;
+	}
+}
+
+void writeTree(std::ofstream &out, const std::vector<TraceEvent> &events, int node, long long sent, int depth, std::unordered_set<int> &visited) {
+	//Writes the supers that received the query from node, then recurses into the ones that weren't duplicates
+	for (auto &event : events) {
+		if (std::get<1>(event) != TRACE_QUERY || std::get<3>(event) != node) {
+			continue;
+		}
+		int receiver = std::get<2>(event);
+		out << std::string(depth * 2, ' ') << "super " << receiver << " +" << (std::get<5>(event) - sent) / 1000.0 << " ms TTL " << std::get<4>(event);
+		if (std::get<6>(event)) {
+			out << " duplicate" << std::endl;
+			continue;
+		}
+		out << " ->";
+		for (int target : std::get<7>(event)) {
+			out << " " << target;
+		}
+		out << std::endl;
+		if (visited.insert(receiver).second) {
+			writeTree(out, events, receiver, sent, depth + 1, visited);
+		}
+	}
+}
+
+std::vector<std::set<int>> buildTopology(int n, std::mt19937 &random) {
+	//Neighbor sets of supers 0 to n - 1; super i gets ID i + 1
+	std::vector<std::set<int>> graph(n);
+	auto link = [&graph](int a, int b) {
+		if (a != b) {
+			graph[a].insert(b);
+			graph[b].insert(a);
+		}
+	};
+	if (topology == ALL_TO_ALL) {
+		for (int a = 0; a < n; a++) {
+			for (int b = a + 1; b < n; b++) {
+				link(a, b);
+			}
+		}
+	}
+	else if (topology == LINEAR) {
+		for (int a = 0; a + 1 < n; a++) {
+			link(a, a + 1);
+		}
+	}
+	else if (topology == RANDOM_REGULAR) {
+		//Union of degree / 2 random Hamiltonian cycles, plus a random matching for odd degrees. Edges two
+		//cycles share are only kept once, so a few supers end up just below the degree
+		std::vector<int> order(n);
+		std::iota(order.begin(), order.end(), 0);
+		for (int cycle = 0; cycle < degree / 2; cycle++) {
+			std::shuffle(order.begin(), order.end(), random);
+			for (int a = 0; a < n; a++) {
+				link(order[a], order[(a + 1) % n]);
+			}
+		}
+		if (degree % 2 == 1) {
+			std::shuffle(order.begin(), order.end(), random);
+			for (int a = 0; a + 1 < n; a += 2) {
+				link(order[a], order[a + 1]);
+			}
+		}
+	}
+	else if (topology == SMALL_WORLD) {
+		//Watts-Strogatz: a ring where each super links to degree / 2 supers on either side, then each
+		//link is rewired to a random super with probability SMALL_WORLD_REWIRE
+		std::uniform_real_distribution<double> chance(0, 1);
+		std::uniform_int_distribution<int> anyone(0, std::max(0, n - 1));
+		for (int a = 0; a < n; a++) {
+			for (int step = 1; step <= std::max(1, degree / 2); step++) {
+				int b = (a + step) % n;
+				if (chance(random) < SMALL_WORLD_REWIRE) {
+					int rewired = anyone(random);
+					if (rewired != a && graph[a].find(rewired) == graph[a].end()) {
+						b = rewired;
+					}
+				}
+				link(a, b);
+			}
+		}
+	}
+	else if (topology == TREE) {
+		//Super 1 is the root and every super has up to degree children
+		for (int a = 1; a < n; a++) {
+			link(a, (a - 1) / degree);
+		}
+	}
+	else if (topology == HYPERCUBE) {
+		//Supers are linked when their indices differ in one bit. Missing corners of an incomplete cube
+		//don't disconnect it, since clearing the top bit of an index always lands on a super
+		for (int a = 0; a < n; a++) {
+			for (int bit = 1; bit < n; bit <<= 1) {
+				if ((a ^ bit) < n) {
+					link(a, a ^ bit);
+				}
+			}
+		}
+	}
+	connectComponents(graph);
+	return graph;
+}
+
+void connectComponents(std::vector<std::set<int>> &graph) {
+	//Rewiring can split a random graph; chain any pieces together so every super can be reached
+	std::vector<int> component(graph.size(), -1);
+	int previous = -1;
+	for (int start = 0; start < int(graph.size()); start++) {
+		if (component[start] >= 0) {
+			continue;
+		}
+		if (previous >= 0) {
+			graph[previous].insert(start);
+			graph[start].insert(previous);
+		}
+		previous = start;
+		std::vector<int> stack = { start };
+		component[start] = start;
+		while (!stack.empty()) {
+			int node = stack.back();
+			stack.pop_back();
+			for (int neighbor : graph[node]) {
+				if (component[neighbor] < 0) {
+					component[neighbor] = start;
+					stack.push_back(neighbor);
+				}
+			}
+		}
+	}
+}
+
+int diameterOf(const std::vector<std::set<int>> &graph) {
+	//Longest shortest path between two supers. Closed forms for the regular shapes, two sweeps for a
+	//tree, and a breadth-first search out of every super otherwise
+	int n = int(graph.size());
+	if (n <= 1) {
+		return 0;
+	}
+	if (topology == ALL_TO_ALL) {
+		return 1;
+	}
+	if (topology == LINEAR) {
+		return n - 1;
+	}
+	if (topology == HYPERCUBE) {
+		int bits = 0;
+		while ((1 << bits) < n) {
+			bits++;
+		}
+		return bits;
+	}
+	int farthest = 0;
+	if (topology == TREE) {
+		eccentricity(graph, eccentricity(graph, 0, farthest), farthest);
+		return farthest;
+	}
+	int diameter = 0;
+	for (int start = 0; start < n; start++) {
+		eccentricity(graph, start, farthest);
+		diameter = std::max(diameter, farthest);
+	}
+	return diameter;
+}
+
+int eccentricity(const std::vector<std::set<int>> &graph, int start, int &distance) {
+	//Breadth-first search from start; returns the last super reached and sets distance to how far it is
+	std::vector<int> hops(graph.size(), -1);
+	std::queue<int> frontier;
+	frontier.push(start);
+	hops[start] = 0;
+	int last = start;
+	while (!frontier.empty()) {
+		last = frontier.front();
+		frontier.pop();
+		for (int neighbor : graph[last]) {
+			if (hops[neighbor] < 0) {
+				hops[neighbor] = hops[last] + 1;
+				frontier.push(neighbor);
+			}
+		}
+	}
+	distance = hops[last];
+	return last;
 }
 
+std::string writeNeighbors(int id, const std::set<int> &neighbors) {
+	//Writes the IDs of a super's neighbors to its own file and returns the path
+	std::string path = std::string(TOPOLOGY_DIRECTORY) + "/" + std::to_string(id) + ".txt";
+	std::ofstream out(path);
+	for (int neighbor : neighbors) {
+		out << neighbor + 1 << std::endl;
+	}
+	return path;
+}
+
+void makeDirectory(const std::string &path) {
+#ifndef GNUTELLA_SIMULATION
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+double percentileOf(std::vector<double> values, double q) {
+	if (values.empty()) {
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, size_t(q * values.size()))];
+}
+
+#ifdef GNUTELLA_SIMULATION
+void run(NodeEntry entry, std::string args) {
+	//Runs a node on its own thread, splitting args into words the way a command line would be. The
+	//thread lives as long as the process, so the thread limit (ulimit -u) caps how many nodes one run can have
+	std::thread([entry, args]() {
+		std::istringstream stream(args);
+		std::vector<std::string> words((std::istream_iterator<std::string>(stream)), std::istream_iterator<std::string>());
+		std::vector<char *> argv;
+		for (auto &word : words) {
+			argv.push_back(&word[0]);
+		}
+		entry(int(argv.size()), argv.data());
+	}).detach();
+}
+#else
 void copyAppend(char *source, char *destination, int destSize, std::string extra) {
 	strcpy_s(destination, destSize, source);
 	strcat_s(destination, destSize, extra.c_str());
@@ -274,4 +728,5 @@ void run(LPCSTR name, std::string args) {
 	// Close process and thread handles. 
 	CloseHandle(pi.hProcess);
 	CloseHandle(pi.hThread);
-}
\ No newline at end of file
+}
+#endif
@@ -1,8 +1,11 @@
-#include "rpc/server.h"
-#include "rpc/client.h"
-#include "rpc/this_handler.h"
-#include "rpc/this_server.h"
-#include "rpc/rpc_error.h"
+#include "../Common/Transport.h"
+#include "../Common/Bootstrap.h"
+#include "../Common/ConnectionPool.h"
+#include "../Common/FileId.h"
+#include "../Common/Log.h"
+#include "../Common/Stats.h"
+#include "../Common/Trace.h"
+#include "../Common/Workload.h"
 #include <iostream>
 #include <string>
 #include <fstream>
@@ -11,46 +14,179 @@
 #include <vector>
 #include <unordered_set>
 #include <set>
+#include <map>
 #include <unordered_map>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
 #include <thread>
+#include <tuple>
+#include <deque>
+#include <future>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
-void queryHit(int sender, std::array<int, 2> messageId, int TTL, std::string fileName, std::vector<int> leaves);
-void invalidate(std::array<int, 2> messageId, int masterId, int TTL, std::string fileName, int versionNumber);
-void downloadFile(std::vector<int> sources, std::string fileName);
-void obtain(int sender, std::string fileName);
-void receive(std::string fileName, std::vector<uint8_t> bytes, int version, int masterId);
-bool upToDate(std::string fileName, int version);
-rpc::client* getClient(int clientId);
-void start();
-void end();
-std::string getPath();
-
-int id, superId, nSupers, startTTL;
-bool isExtra;
-bool push = false, pull1 = false, pull2 = false;
-int nextMessageId = 0;
-int pendingQueries = 0;
-int valid = 0, invalid = 0;
-std::unordered_map<std::string, std::array<int, 2>> retrievedFiles;
-std::unordered_set<std::string> invalidFiles;
-std::unordered_map<std::string, int> ownFiles;
-std::unordered_map<int, rpc::client*> leafClients;
-std::vector<std::thread> downloadThreads;
-rpc::client *superClient;
-
-bool canStart = false, canEnd = false;
-std::mutex waitLock;
-std::mutex queryCount;
-std::mutex clientsLock;
-std::mutex versionLock;
-std::mutex metricLock;
-std::mutex printlock;
-std::condition_variable ready;
+#define CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNKS_PER_SOURCE 8
+#define CHUNK_TIMEOUT_MS 10000
+#define CHUNK_WAIT_MS 100
+#define DOWNLOAD_WORKERS 4
+#define DOWNLOAD_SOURCES 4
+#define ADD_BATCH_SIZE 10000
+#define LEASE_MIN_MS 100
+#define LEASE_MAX_MS 10000
+#define LEASE_INITIAL_MS 1000
+#define LEASE_UPDATE_SHARE 0.5
+#define LEASE_SMOOTHING 0.25
+#define LEASE_AUDIT_MS 500
+#define QUERY_BATCH_SIZE 256
+#define QUERY_DEADLINE_MS 10000
+#define QUERY_RING_STEP_MS 100
+#define QUERY_TIMER_MAX_MS 1000
 
+typedef std::pair<std::array<int, 2>, FileId> QueryEntry; // (messageId, fileId)
+typedef std::tuple<std::array<int, 2>, FileId, std::vector<int>> HitEntry; // (messageId, fileId, leaves)
+typedef std::pair<std::string, int> Registration; // (file name, version)
+
+struct PartialDownload {
+	int version = -1;
+	int master = -1;
+	long long size = -1;
+	std::vector<bool> haveChunk;
+};
+
+//A query still waiting for its file. Every retry goes out under a new message ID, so supers don't drop it
+//as a duplicate of the attempt before
+struct OutstandingQuery {
+	int TTL; //TTL of the latest attempt
+	std::chrono::steady_clock::time_point retryAt; //When to widen the search if nothing answered
+	std::chrono::steady_clock::time_point deadline; //When to give up, QUERY_DEADLINE_MS after the first attempt at the full TTL
+	bool answered;
+};
+
+//Time-to-refresh lease on a copy we hold but don't own (mode 5)
+struct Lease {
+	std::chrono::steady_clock::time_point expires;
+	std::vector<long long> servedAt; //Wall clock micros of each serve since the copy was last validated
+};
+
+//Update history of a file we own, for sizing leases and dating stale copies (mode 5)
+struct UpdateHistory {
+	std::map<int, long long> madeAt; //version -> wall clock micros it was made
+	double meanIntervalMs = 0;
+};
+
+struct SwarmSource {
+	int id;
+	std::shared_ptr<Client> client;
+	std::deque<std::pair<int, Stats::PendingCall>> inFlight;
+	std::chrono::steady_clock::time_point lastProgress;
+	bool failed;
+};
+
+class Leaf {
+public:
+	int run(int argc, char* argv[]);
+
+private:
+	void queryHit(int sender, std::array<int, 2> messageId, int TTL, FileId fileId, std::vector<int> leaves);
+	void queryHitBatch(int sender, int TTL, std::vector<HitEntry> hits);
+	void invalidate(std::array<int, 2> messageId, int masterId, int TTL, FileId fileId, int versionNumber);
+	void sendQueries(int TTL, const std::vector<QueryEntry> &batch);
+	void retryQueries();
+	void settleQuery(FileId fileId, bool found);
+	std::chrono::steady_clock::time_point nextQueryTimer();
+	void queueDownload(std::vector<int> sources, FileId fileId);
+	void addSources(std::vector<int> sources, FileId fileId);
+	void downloadWorker();
+	void downloadFile(std::vector<int> sources, FileId fileId);
+	bool transferFile(std::vector<int> sources, FileId fileId, int version, int master, long long size, long long leaseMs);
+	std::tuple<int, int, long long, long long> obtain(int sender, FileId fileId);
+	std::vector<uint8_t> obtainChunk(FileId fileId, long long offset);
+	void receive(FileId fileId, int version, int masterId, long long leaseMs);
+	void registerFiles(const std::vector<Registration> &files);
+	void queueAdd(FileId fileId, int version);
+	void registrar();
+	bool upToDate(FileId fileId, int version);
+	std::tuple<long long, long long> renewLease(FileId fileId, int version);
+	long long leaseFor(FileId fileId);
+	void recordUpdate(FileId fileId, int version);
+	void auditLeases(bool all);
+	bool renewHeldLease(FileId fileId, int version, int master);
+	void leaseLoop();
+	std::shared_ptr<Client> getClient(int clientId);
+	std::array<long long, 5> connectionStats();
+	void start();
+	void startAll(int last);
+	void end();
+	std::string getPath();
+	void makeDirectory(const std::string &path);
+	bool internName(const std::string &fileName, FileId &fileId);
+	std::string nameOf(FileId fileId);
+
+	int id, superId, nSupers, startTTL;
+	int nDownloadWorkers;
+	bool isExtra;
+	bool push = false, pull1 = false, pull2 = false, lease = false;
+	int nextMessageId = 0;
+	int pendingQueries = 0;
+	int failedQueries = 0;
+	int ignoredHits = 0;
+	bool expandingRing = false;
+	std::unordered_map<FileId, OutstandingQuery> outstandingQueries;
+	int valid = 0, invalid = 0;
+	std::unordered_map<FileId, std::array<int, 2>> retrievedFiles;
+	std::unordered_set<FileId> invalidFiles;
+	std::unordered_map<FileId, int> ownFiles;
+	std::unordered_map<FileId, Lease> leases; // held copies -> their lease
+	std::unordered_map<FileId, UpdateHistory> updateHistories; // own files -> when each version was made
+	ConnectionPool peers;
+	std::unordered_map<FileId, std::string> fileNames;
+	std::unordered_map<FileId, PartialDownload> partialDownloads;
+	std::deque<FileId> downloadQueue;
+	std::unordered_map<FileId, std::vector<int>> queuedDownloads;
+	std::unordered_set<FileId> activeDownloads;
+	std::unordered_map<FileId, std::vector<int>> spareSources; // holders from queryHits that arrived while the file was downloading
+	int activeWorkers = 0; // download jobs running, at most nDownloadWorkers
+	bool stopDownloads = false;
+	std::unordered_map<FileId, int> pendingAdds; // downloaded or revalidated files the super hasn't been told about
+	bool registering = false; // a registrar job is running
+	std::shared_ptr<Client> superClient;
+
+	bool canStart = false, canEnd = false;
+	std::mutex waitLock;
+	std::mutex queryCount;
+	std::mutex versionLock;
+	std::mutex metricLock;
+	std::mutex downloadLock;
+	std::mutex nameLock;
+	std::mutex addLock;
+	std::mutex auditLock;
+	std::condition_variable ready;
+	std::condition_variable downloadReady;
+	std::condition_variable addReady;
+};
+
+int runLeaf(int argc, char* argv[]) {
+	//Leaves are objects so the simulation build can run many of them in one process
+	std::unique_ptr<Leaf> node(new Leaf());
+	return node->run(argc, argv);
+}
+
+#ifndef GNUTELLA_SIMULATION
 int main(int argc, char* argv[]) {
+	return runLeaf(argc, argv);
+}
+#endif
+
+int Leaf::run(int argc, char* argv[]) {
 	//Parse args for ID, files to start with, files to request
 	if (argc < 6) {
 		return -1;
@@ -70,43 +206,41 @@ int main(int argc, char* argv[]) {
 	if (mode == 4) {
 		pull2 = true;
 	}
-	std::cout << "Im a leaf with ID " << id << " and my super's ID is " << superId << std::endl;
+	if (mode == 5) {
+		lease = true;
+	}
+	//GNUTELLA_SEARCH=ring starts every query at TTL 1 and widens it until something answers
+	expandingRing = Log::env("GNUTELLA_SEARCH") == "ring";
+	//GNUTELLA_DOWNLOAD_WORKERS caps how many files download at once
+	std::string workers = Log::env("GNUTELLA_DOWNLOAD_WORKERS");
+	nDownloadWorkers = workers.empty() ? DOWNLOAD_WORKERS : std::max(1, std::stoi(workers));
+	Log::start("leaf " + std::to_string(id));
+	LOG_INFO("Im a leaf with ID " << id << " and my super's ID is " << superId);
 	//Start server for start, obtain, and end signals
-	rpc::server server(8000 + id);
-	server.bind("start", &start);
-	server.bind("queryHit", &queryHit);
-	server.bind("obtain", &obtain);
-	server.bind("receive", &receive);
-	server.bind("invalidate", &invalidate);
-	server.bind("upToDate", &upToDate);
-	server.bind("end", &end);
+	Server server(8000 + id);
+	Stats::bind(server, "start", this, &Leaf::start);
+	Stats::bind(server, "startAll", this, &Leaf::startAll);
+	Stats::bind(server, "queryHit", this, &Leaf::queryHit);
+	Stats::bind(server, "queryHitBatch", this, &Leaf::queryHitBatch);
+	Stats::bind(server, "obtain", this, &Leaf::obtain);
+	Stats::bind(server, "obtainChunk", this, &Leaf::obtainChunk);
+	Stats::bind(server, "invalidate", this, &Leaf::invalidate);
+	Stats::bind(server, "upToDate", this, &Leaf::upToDate);
+	Stats::bind(server, "renewLease", this, &Leaf::renewLease);
+	Stats::bind(server, "connectionStats", this, &Leaf::connectionStats);
+	Stats::bind(server, "end", this, &Leaf::end);
+	server.bind("stats", &Stats::report);
+	server.bind("trace", &Trace::report);
 	server.bind("stop_server", []() {
-		rpc::this_server().stop();
+		stopServer();
 	});
 	server.async_run(4);
-	//Create super client
-	superClient = new rpc::client("localhost", 8000 + superId);
-	superClient->set_timeout(1000);
-	//Ping server until it responds
-	while (true) {
-		try {
-			std::cout << "Pinging" << std::endl;
-			superClient->call("ping");
-			std::cout << "Ping was successful" << std::endl;
-			break;
-		}
-		catch (rpc::timeout &t) {
-			//Ping timed out, try restarting client
-			delete superClient;
-			superClient = new rpc::client("localhost", 8000 + superId);
-			superClient->set_timeout(1000);
-			t; //Silence warning
-		}
-	}
-	superClient->clear_timeout();
-	//Create init files & add to super index
-	CreateDirectory("Leaves", NULL);
-	CreateDirectory(getPath().c_str(), NULL);
+	//Create super client once the super is online
+	superClient = Bootstrap::connect(superId);
+	//Create init files & add them to the super index in bulk
+	makeDirectory("Leaves");
+	makeDirectory(getPath());
+	std::vector<Registration> initialFiles;
 	int argIndex;
 	for (argIndex = 6; argIndex < argc; argIndex++) {
 		if (strcmp(argv[argIndex], std::string("requests").c_str()) == 0) {
@@ -114,43 +248,75 @@ int main(int argc, char* argv[]) {
 			break;
 		}
 		std::string fileName(argv[argIndex]);
-		std::ofstream file(getPath() + fileName);
-		file << "Created by leaf " << id << std::endl;
-		std::srand(unsigned int(std::time(nullptr)));
-		for (int i = 0; i < argIndex * 1024; i++) {
-			file << char((std::rand() % 95) + 32);
+		FileId fileId;
+		if (!internName(fileName, fileId)) {
+			continue;
 		}
+		std::ofstream file(getPath() + fileName, std::ios::binary);
+		file << "Created by leaf " << id << std::endl;
+		Workload::writeContent(file, Workload::current().fileSize(fileName, argIndex * 1024), fileIdOf(fileName) ^ (uint64_t)std::time(nullptr));
 		file.close();
-		ownFiles.insert({ fileName, 0 });
-		superClient->call("add", id, fileName, 0);
+		ownFiles.insert({ fileId, 0 });
+		initialFiles.push_back({ fileName, 0 });
 	}
-	std::cout << "Call super" << std::endl;
+	registerFiles(initialFiles);
+	LOG_DEBUG("Call super");
 	//Send ready signal to super
-	superClient->call("ready");
+	superClient->call("ready", id);
 	//Wait for start signal
 	std::unique_lock<std::mutex> unique(waitLock);
-	ready.wait(unique, [] { return canStart; });
-	std::cout << "Ready to rumble" << std::endl;
-	//Make file requests
+	ready.wait(unique, [this] { return canStart; });
+	LOG_INFO("Ready to rumble");
+	if (lease) {
+		//Renew leases on their own timer, whether or not this leaf has files of its own to update
+		runAfter(std::chrono::milliseconds(LEASE_AUDIT_MS), [this] { leaseLoop(); });
+	}
+	//Make file requests: all at once, QUERY_BATCH_SIZE per message, or one at a time as the workload's
+	//arrival process dictates
+	const Workload &workload = Workload::current();
+	std::mt19937 arrivals(workload.seed + id);
+	auto nextArrival = std::chrono::steady_clock::now();
+	std::vector<QueryEntry> batch;
+	std::unordered_set<FileId> requested;
 	for (; argIndex < argc; argIndex++) {
 		std::string fileName(argv[argIndex]);
-		printlock.lock();
-		std::cout << "Querying for " << fileName << std::endl;
-		printlock.unlock();
-		std::array<int, 2> messageId = { id, nextMessageId++ };
-		//std::cout << "mId: " << messageId[0] << " " << messageId[1] << std::endl;
-		superClient->async_call("query", id, messageId, startTTL, fileName);
+		FileId fileId;
+		//A file asked for twice is fetched once
+		if (internName(fileName, fileId) && requested.insert(fileId).second) {
+			LOG_DEBUG("Querying for " << fileName);
+			std::array<int, 2> messageId = { id, nextMessageId++ };
+			batch.push_back(QueryEntry(messageId, fileId));
+		}
+		if (!batch.empty() && (workload.openLoop() || batch.size() >= QUERY_BATCH_SIZE || argIndex == argc - 1)) {
+			if (workload.openLoop()) {
+				nextArrival += workload.nextArrival(arrivals);
+				std::this_thread::sleep_until(nextArrival);
+			}
+			sendQueries(expandingRing ? 1 : startTTL, batch);
+			batch.clear();
+		}
+	}
+	//Widen unanswered queries and give up on the ones past their deadline until every query is settled
+	while (true) {
 		queryCount.lock();
-		pendingQueries++;
+		bool settled = pendingQueries == 0;
 		queryCount.unlock();
+		if (settled) {
+			break;
+		}
+		ready.wait_until(unique, nextQueryTimer());
+		retryQueries();
+	}
+	if (failedQueries > 0) {
+		LOG_WARN(failedQueries << " queries found nothing within " << QUERY_DEADLINE_MS << " ms of searching at full TTL");
 	}
-	ready.wait(unique, [] { return pendingQueries == 0; });
+	LOG_DEBUG("Ignored " << ignoredHits << " queryHits for files already settled");
 	//Send complete signal to system
-	rpc::client sysClient("localhost", 8000);
+	Client sysClient("localhost", 8000);
 	sysClient.call("complete");
 	//Make 'updates' to random ownFiles
-	std::srand(unsigned int(std::time(nullptr) + id));
-	std::cout << "Starting to make random file updates" << std::endl;
+	std::srand((unsigned int)(std::time(nullptr) + id));
+	LOG_INFO("Starting to make random file updates");
 	while (!canEnd) {
 		if (ownFiles.empty()) {
 			break;
@@ -160,276 +326,879 @@ int main(int argc, char* argv[]) {
 			break;
 		}
 		file->second++;
+		if (lease) {
+			recordUpdate(file->first, file->second);
+		}
 		if (pull2) {
-			superClient->async_call("updateVersion", id, file->first, file->second);
+			Stats::asyncCall(superClient, "updateVersion", id, file->first, file->second);
 		}
 		if (push) {
 			//send push message to super
-			printlock.lock();
-			std::cout << "Pushing invalidate for version " << file->second << " of " << file->first << std::endl;
-			printlock.unlock();
+			LOG_DEBUG("Pushing invalidate for version " << file->second << " of " << nameOf(file->first));
 			std::array<int, 2> messageId = { id, nextMessageId++ };
 			try {
-				superClient->async_call("invalidate", messageId, id, startTTL, file->first, file->second);
+				Stats::asyncCall(superClient, "invalidate", messageId, id, startTTL, file->first, file->second);
 			}
 			catch (...) {
-				std::cout << "Error pushing invalidate" << std::endl;
+				LOG_WARN("Error pushing invalidate");
 			}
 		}
-		std::cout << "Updated " << file->first << " to version " << file->second << std::endl;
+		LOG_DEBUG("Updated " << nameOf(file->first) << " to version " << file->second);
 		std::this_thread::sleep_for(std::chrono::milliseconds(std::rand() % 1000));
 	}
-	std::cout << "wait for kill" << std::endl;
+	LOG_INFO("wait for kill");
+	if (lease) {
+		//Check every copy served since its last renewal, so stale serves all get counted
+		auditLeases(true);
+	}
 	//Report metrics
 	metricLock.lock();
 	if (!isExtra) {
 		valid = 0;
 	}
-	sysClient.call("metrics", valid, invalid);
+	sysClient.call("metrics", valid, invalid, failedQueries);
 	metricLock.unlock();
 	//Wait for kill signal
-	ready.wait(unique, [] { return canEnd && false; });
+	ready.wait(unique, [this] { return canEnd && false; });
 	//Wait for own server to end gracefully
-	printlock.lock();
-	std::cout << "collecting threads" << std::endl;
-	printlock.unlock();
-	for (std::thread& thread : downloadThreads) {
-		thread.join();
-	}
-	printlock.lock();
-	std::cout << "got threads" << std::endl;
-	printlock.unlock();
+	LOG_DEBUG("collecting threads");
+	std::unique_lock<std::mutex> downloads(downloadLock);
+	stopDownloads = true;
+	downloadReady.wait(downloads, [this] { return activeWorkers == 0; });
+	downloads.unlock();
+	std::unique_lock<std::mutex> adds(addLock);
+	addReady.wait(adds, [this] { return !registering; });
+	adds.unlock();
+	LOG_DEBUG("got threads");
 	std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-	delete superClient;
-	rpc::client selfClient("localhost", 8000 + id);
+	superClient.reset();
+	Client selfClient("localhost", 8000 + id);
 	selfClient.call("stop_server");
-	for (auto client : leafClients) {
-		delete client.second;
+	LOG_INFO("dead");
+	Log::shutdown();
+	return 0;
+}
+
+void Leaf::queryHit(int sender, std::array<int, 2> messageId, int, FileId fileId, std::vector<int> leaves) {
+	LOG_DEBUG("queryhit for " << nameOf(fileId) << " from " << sender);
+	if (Trace::enabled()) {
+		Trace::hitReceived(messageId);
+	}
+	//Stop widening the search. Hits for a query that already landed its file, or gave up, are dropped
+	queryCount.lock();
+	auto query = outstandingQueries.find(fileId);
+	bool wanted = query != outstandingQueries.end();
+	if (wanted) {
+		query->second.answered = true;
+	}
+	else {
+		ignoredHits++;
+	}
+	queryCount.unlock();
+	if (wanted) {
+		addSources(leaves, fileId);
 	}
-	std::cout << "dead" << std::endl;
 }
 
-void queryHit(int sender, std::array<int, 2> messageId, int TTL, std::string fileName, std::vector<int> leaves) {
-	printlock.lock();
-	std::cout << "queryhit for " << fileName << " from " << sender << std::endl;
-	printlock.unlock();
-	//Try to copy file from each source in another thread until success
-	std::thread dlThread = std::thread(downloadFile, leaves, fileName);
-	downloadThreads.push_back(std::move(dlThread));
+void Leaf::queryHitBatch(int sender, int TTL, std::vector<HitEntry> hits) {
+	for (auto &hit : hits) {
+		queryHit(sender, std::get<0>(hit), TTL, std::get<1>(hit), std::get<2>(hit));
+	}
 }
 
-void invalidate(std::array<int, 2> messageId, int masterId, int TTL, std::string fileName, int versionNumber) {
+void Leaf::invalidate(std::array<int, 2>, int masterId, int, FileId fileId, int versionNumber) {
 	versionLock.lock();
-	const auto &fileIter = retrievedFiles.find(fileName);
+	const auto &fileIter = retrievedFiles.find(fileId);
 	if (fileIter != retrievedFiles.end() && fileIter->second[0] < versionNumber) {
-		printlock.lock();
-		std::cout << "Re-Downloading " << fileName << " version " << versionNumber << std::endl;
+		LOG_DEBUG("Re-Downloading " << nameOf(fileId) << " version " << versionNumber);
 		//Update version number preemptively to block repeat invalidations
 		fileIter->second[0] = versionNumber;
 		//Mark file as invalid
-		invalidFiles.insert(fileName);
-		std::cout << "invalidated " << fileName << std::endl;
-		printlock.unlock();
+		invalidFiles.insert(fileId);
+		LOG_DEBUG("invalidated " << nameOf(fileId));
 		//Download file from master
 		if (masterId == -1) {
 			masterId = fileIter->second[1];
 		}
-		std::vector<int> sourceIds = { masterId };
-		std::thread dlThread = std::thread(downloadFile, sourceIds, fileName);
-		downloadThreads.push_back(std::move(dlThread));
+		queueDownload({ masterId }, fileId);
 	}
 	versionLock.unlock();
 }
 
-void downloadFile(std::vector<int> sources, std::string fileName) {
-	for (unsigned int i = 0; i < sources.size(); i++) {
-		try {
-			printlock.lock();
-			std::cout << "Sending file request to " << sources[i] << " for " << fileName << std::endl;
-			printlock.unlock();
-			//Download file
-			getClient(sources[i])->async_call("obtain", id, fileName);
+void Leaf::queueDownload(std::vector<int> sources, FileId fileId) {
+	//Queue a download, merging sources into any job already waiting for the same file
+	downloadLock.lock();
+	auto queued = queuedDownloads.find(fileId);
+	if (queued != queuedDownloads.end()) {
+		for (int source : sources) {
+			if (std::find(queued->second.begin(), queued->second.end(), source) == queued->second.end()) {
+				queued->second.push_back(source);
+			}
+		}
+	}
+	else {
+		queuedDownloads.insert({ fileId, sources });
+		downloadQueue.push_back(fileId);
+	}
+	//Jobs already running pick it up once they finish their current file; start another if there's room
+	bool startWorker = !stopDownloads && activeWorkers < nDownloadWorkers;
+	if (startWorker) {
+		activeWorkers++;
+	}
+	downloadLock.unlock();
+	if (startWorker) {
+		runInBackground([this] { downloadWorker(); });
+	}
+}
+
+void Leaf::addSources(std::vector<int> sources, FileId fileId) {
+	//Holders from another hit for a file being downloaded become spares for that download rather than a
+	//second job, so each request fetches one copy
+	downloadLock.lock();
+	if (activeDownloads.find(fileId) != activeDownloads.end()) {
+		std::vector<int> &spares = spareSources[fileId];
+		for (int source : sources) {
+			if (std::find(spares.begin(), spares.end(), source) == spares.end()) {
+				spares.push_back(source);
+			}
+		}
+		downloadLock.unlock();
+		return;
+	}
+	downloadLock.unlock();
+	queueDownload(sources, fileId);
+}
+
+void Leaf::downloadWorker() {
+	//Run queued downloads until none is left to start, never two for the same file at once. A file held
+	//back because it is already downloading is picked up by the job downloading it
+	std::unique_lock<std::mutex> guard(downloadLock);
+	while (true) {
+		auto next = std::find_if(downloadQueue.begin(), downloadQueue.end(), [this](FileId fileId) {
+			return activeDownloads.find(fileId) == activeDownloads.end();
+		});
+		if (stopDownloads || next == downloadQueue.end()) {
+			activeWorkers--;
+			downloadReady.notify_all();
+			return;
+		}
+		FileId fileId = *next;
+		downloadQueue.erase(next);
+		std::vector<int> sources = std::move(queuedDownloads[fileId]);
+		queuedDownloads.erase(fileId);
+		activeDownloads.insert(fileId);
+		guard.unlock();
+		downloadFile(sources, fileId);
+		versionLock.lock();
+		bool landed = retrievedFiles.find(fileId) != retrievedFiles.end();
+		versionLock.unlock();
+		guard.lock();
+		activeDownloads.erase(fileId);
+		std::vector<int> spares;
+		auto spare = spareSources.find(fileId);
+		if (spare != spareSources.end()) {
+			spares = std::move(spare->second);
+			spareSources.erase(spare);
+		}
+		if (!landed && !spares.empty()) {
+			//Sources that turned up too late for the last attempt get one of their own
+			guard.unlock();
+			queueDownload(spares, fileId);
+			guard.lock();
+		}
+		else if (!landed && queuedDownloads.find(fileId) == queuedDownloads.end()) {
+			//Every source failed and no other hit is queued, so search again
+			queryCount.lock();
+			auto query = outstandingQueries.find(fileId);
+			if (query != outstandingQueries.end()) {
+				query->second.answered = false;
+				query->second.retryAt = std::chrono::steady_clock::now();
+			}
+			queryCount.unlock();
+			ready.notify_one();
+		}
+	}
+}
+
+void Leaf::downloadFile(std::vector<int> sources, FileId fileId) {
+	//Works through the sources DOWNLOAD_SOURCES at a time, moving on to the next ones, and any spares
+	//later hits added, only when a round fails. Partial chunks carry over between rounds
+	size_t next = 0;
+	while (true) {
+		//Stop once an earlier job or round fetched a valid copy
+		versionLock.lock();
+		bool needed = retrievedFiles.find(fileId) == retrievedFiles.end() || invalidFiles.find(fileId) != invalidFiles.end();
+		versionLock.unlock();
+		if (!needed) {
+			return;
+		}
+		downloadLock.lock();
+		auto spare = spareSources.find(fileId);
+		if (spare != spareSources.end()) {
+			for (int source : spare->second) {
+				if (std::find(sources.begin(), sources.end(), source) == sources.end()) {
+					sources.push_back(source);
+				}
+			}
+			spareSources.erase(spare);
+		}
+		downloadLock.unlock();
+		if (next >= sources.size()) {
+			return;
+		}
+		std::vector<int> candidates(sources.begin() + next, sources.begin() + std::min(sources.size(), next + DOWNLOAD_SOURCES));
+		next += candidates.size();
+		//Ask this round's sources for their version in parallel
+		std::vector<Stats::PendingCall> replies;
+		for (int source : candidates) {
+			LOG_DEBUG("Sending file request to " << source << " for " << nameOf(fileId));
+			replies.push_back(Stats::asyncCall(getClient(source), "obtain", id, fileId));
+		}
+		std::vector<std::tuple<int, int, long long, long long>> infos(candidates.size(), std::tuple<int, int, long long, long long>(-1, -1, -1, 0));
+		for (unsigned int i = 0; i < candidates.size(); i++) {
+			try {
+				if (replies[i].wait_for(std::chrono::milliseconds(CHUNK_TIMEOUT_MS)) == std::future_status::ready) {
+					infos[i] = replies[i].get().as<std::tuple<int, int, long long, long long>>();
+				}
+			}
+			catch (std::exception &e) {
+				//Refusals, dropped connections and malformed replies alike leave this source out of the round
+				LOG_WARN("Error downloading " << nameOf(fileId) << " from " << candidates[i] << ": " << e.what());
+			}
+		}
+		//Swarm across every source holding the newest version
+		int newest = -1;
+		for (auto &info : infos) {
+			newest = std::max(newest, std::get<0>(info));
+		}
+		std::vector<int> swarm;
+		int master = -1;
+		long long size = -1;
+		long long leaseMs = 0;
+		for (unsigned int i = 0; i < candidates.size(); i++) {
+			if (newest >= 0 && std::get<0>(infos[i]) == newest && (size < 0 || std::get<2>(infos[i]) == size)) {
+				swarm.push_back(candidates[i]);
+				master = std::get<1>(infos[i]);
+				size = std::get<2>(infos[i]);
+				leaseMs = std::max(leaseMs, std::get<3>(infos[i]));
+			}
+		}
+		if (!swarm.empty() && transferFile(swarm, fileId, newest, master, size, leaseMs)) {
+			return;
 		}
-		catch (rpc::rpc_error &e) {
-			printlock.lock();
-			std::cout << "Error downloading " << fileName << " from " << sources[i] << ": " << e.what() << std::endl;
-			printlock.unlock();
+	}
+}
+
+bool Leaf::transferFile(std::vector<int> sources, FileId fileId, int version, int master, long long size, long long leaseMs) {
+	//Resume from a previous partial transfer of the same version, otherwise start over
+	int nChunks = int((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	bool resuming = false;
+	downloadLock.lock();
+	PartialDownload &partial = partialDownloads[fileId];
+	if (partial.version == version && partial.size == size && int(partial.haveChunk.size()) == nChunks) {
+		resuming = true;
+	}
+	else {
+		partial = { version, master, size, std::vector<bool>(nChunks, false) };
+	}
+	std::deque<int> pending;
+	for (int chunk = 0; chunk < nChunks; chunk++) {
+		if (!partial.haveChunk[chunk]) {
+			pending.push_back(chunk);
 		}
-		catch (...) {
-			std::cout << "something else broke" << std::endl;
-			std::cin.get();
+	}
+	downloadLock.unlock();
+	std::string partPath = getPath() + nameOf(fileId) + ".part";
+	std::fstream destination;
+	if (resuming) {
+		destination.open(partPath, std::ios::binary | std::ios::in | std::ios::out);
+		LOG_DEBUG("Resuming " << nameOf(fileId) << " with " << pending.size() << " of " << nChunks << " chunks left");
+	}
+	if (!destination.is_open()) {
+		destination.open(partPath, std::ios::binary | std::ios::out | std::ios::trunc);
+	}
+	if (!destination) {
+		return false;
+	}
+	//Each source keeps a window of chunk requests outstanding; chunks of a failed source go back in the queue
+	std::deque<SwarmSource> swarm;
+	for (int source : sources) {
+		swarm.push_back({ source, getClient(source), {}, std::chrono::steady_clock::now(), false });
+	}
+	int remaining = int(pending.size());
+	int alive = int(swarm.size());
+	while (remaining > 0 && alive > 0) {
+		for (auto &source : swarm) {
+			if (source.inFlight.empty()) {
+				source.lastProgress = std::chrono::steady_clock::now();
+			}
+			while (!source.failed && source.inFlight.size() < MAX_CHUNKS_PER_SOURCE && !pending.empty()) {
+				int chunk = pending.front();
+				pending.pop_front();
+				source.inFlight.push_back({ chunk, Stats::asyncCall(source.client, "obtainChunk", fileId, (long long)chunk * CHUNK_SIZE) });
+			}
 		}
+		bool progressed = false;
+		for (auto &source : swarm) {
+			if (source.failed || source.inFlight.empty()) {
+				continue;
+			}
+			auto &request = source.inFlight.front();
+			if (request.second.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) {
+				if (std::chrono::steady_clock::now() - source.lastProgress > std::chrono::milliseconds(CHUNK_TIMEOUT_MS)) {
+					LOG_WARN("Chunk requests for " << nameOf(fileId) << " to " << source.id << " timed out");
+					source.failed = true;
+					peers.discard(source.id, source.client);
+				}
+			}
+			else {
+				int chunk = request.first;
+				long long expected = std::min<long long>(CHUNK_SIZE, size - (long long)chunk * CHUNK_SIZE);
+				std::vector<uint8_t> bytes;
+				try {
+					bytes = request.second.get().as<std::vector<uint8_t>>();
+				}
+				catch (std::exception &e) {
+					//Any failure leaves bytes empty, so the chunk goes back in the queue and the source is dropped
+					LOG_WARN("Error downloading chunk of " << nameOf(fileId) << " from " << source.id << ": " << e.what());
+				}
+				source.inFlight.pop_front();
+				if ((long long)bytes.size() != expected) {
+					pending.push_front(chunk);
+					source.failed = true;
+				}
+				else {
+					destination.seekp((long long)chunk * CHUNK_SIZE);
+					destination.write((char *)bytes.data(), bytes.size());
+					downloadLock.lock();
+					partialDownloads[fileId].haveChunk[chunk] = true;
+					downloadLock.unlock();
+					remaining--;
+					source.lastProgress = std::chrono::steady_clock::now();
+					progressed = true;
+				}
+			}
+			if (source.failed) {
+				//Reassign everything this source still owed
+				alive--;
+				for (auto &owed : source.inFlight) {
+					pending.push_front(owed.first);
+				}
+				source.inFlight.clear();
+			}
+		}
+		if (!progressed) {
+			//Block on the oldest outstanding request rather than spin, so idle downloads cost no CPU
+			for (auto &source : swarm) {
+				if (!source.failed && !source.inFlight.empty()) {
+					source.inFlight.front().second.wait_for(std::chrono::milliseconds(CHUNK_WAIT_MS));
+					break;
+				}
+			}
+		}
+	}
+	destination.close();
+	if (remaining > 0) {
+		return false;
 	}
+	//Move the completed file into place
+	std::remove((getPath() + nameOf(fileId)).c_str());
+	std::rename(partPath.c_str(), (getPath() + nameOf(fileId)).c_str());
+	downloadLock.lock();
+	partialDownloads.erase(fileId);
+	downloadLock.unlock();
+	receive(fileId, version, master, leaseMs);
+	return true;
 }
 
-void obtain(int sender, std::string fileName) {
-	//TODO: If pull consistency enabled, check version against owner and error is out-of-date
-	printlock.lock();
-	std::cout << "Obtain request for " << fileName << std::endl;
-	printlock.unlock();
-	if (invalidFiles.find(fileName) != invalidFiles.end()) {
+std::tuple<int, int, long long, long long> Leaf::obtain(int, FileId fileId) {
+	//Validates the request and returns (version, master, size, lease ms); the bytes are fetched with obtainChunk
+	LOG_DEBUG("Obtain request for " << nameOf(fileId));
+	versionLock.lock();
+	if (invalidFiles.find(fileId) != invalidFiles.end()) {
+		versionLock.unlock();
 		metricLock.lock();
 		invalid++;
 		metricLock.unlock();
-		rpc::this_handler().respond_error("File out of date");
-		return;
+		respondError("File out of date");
+		return {};
 	}
 	//Get version number to return
-	versionLock.lock();
 	int version = -1;
 	int master = -1;
-	auto ownIter = ownFiles.find(fileName);
+	long long leaseMs = 0;
+	auto ownIter = ownFiles.find(fileId);
 	if (ownIter != ownFiles.end()) {
 		//We are the original owner of the file
 		version = ownIter->second;
 		master = id;
+		if (lease) {
+			leaseMs = leaseFor(fileId);
+		}
 		versionLock.unlock();
 	}
 	else {
-		auto retrievedIter = retrievedFiles.find(fileName);
-		if (retrievedIter != retrievedFiles.end()) {
+		auto retrievedIter = retrievedFiles.find(fileId);
+		if (retrievedIter != retrievedFiles.end() && lease) {
+			//Serve under our lease without asking the master. A copy passes on only what is left of the
+			//lease, so none outlives the master's grant. Once the lease has run out, the master has to
+			//renew it before the copy is served again
+			version = retrievedIter->second[0];
+			master = retrievedIter->second[1];
+			long long left = std::chrono::duration_cast<std::chrono::milliseconds>(leases[fileId].expires - std::chrono::steady_clock::now()).count();
+			if (left <= 0) {
+				versionLock.unlock();
+				if (!renewHeldLease(fileId, version, master)) {
+					respondError("File out of date");
+					return {};
+				}
+				versionLock.lock();
+				if (invalidFiles.find(fileId) != invalidFiles.end()) {
+					versionLock.unlock();
+					respondError("File out of date");
+					return {};
+				}
+			}
+			Lease &held = leases[fileId];
+			left = std::chrono::duration_cast<std::chrono::milliseconds>(held.expires - std::chrono::steady_clock::now()).count();
+			leaseMs = std::max(0LL, left);
+			held.servedAt.push_back(Trace::now());
 			versionLock.unlock();
+		}
+		else if (retrievedIter != retrievedFiles.end()) {
 			//We're holding the file, but aren't the owner
-			printlock.lock();
-			std::cout << "Checking version of " << fileName << std::endl;
-			printlock.unlock();
-			if (!pull1 || getClient(retrievedIter->second[1])->call("upToDate", fileName, retrievedIter->second[0]).as<bool>()) {
-				printlock.lock();
-				std::cout << "File up to date" << std::endl;
-				printlock.unlock();
-				version = retrievedIter->second[0];
-				master = retrievedIter->second[1];
+			int heldVersion = retrievedIter->second[0];
+			int heldMaster = retrievedIter->second[1];
+			versionLock.unlock();
+			LOG_DEBUG("Checking version of " << nameOf(fileId));
+			if (!pull1 || Stats::call(getClient(heldMaster), "upToDate", fileId, heldVersion).as<bool>()) {
+				LOG_DEBUG("File up to date");
+				version = heldVersion;
+				master = heldMaster;
 			}
 			else {
-				printlock.lock();
-				std::cout << "File out of date" << std::endl;
-				printlock.unlock();
+				LOG_DEBUG("File out of date");
 				//Mark file as invalid
-				invalidFiles.insert(fileName);
+				versionLock.lock();
+				invalidFiles.insert(fileId);
+				versionLock.unlock();
 				//Download file from master
-				std::vector<int> sourceIds = { retrievedIter->second[1] };
-				std::thread dlThread = std::thread(downloadFile, sourceIds, fileName);
-				downloadThreads.push_back(std::move(dlThread));
+				queueDownload({ heldMaster }, fileId);
 				//return error
 				metricLock.lock();
 				invalid++;
 				metricLock.unlock();
-				rpc::this_handler().respond_error("File out of date");
-				return;
+				respondError("File out of date");
+				return {};
 			}
 		}
 		else {
 			versionLock.unlock();
 		}
 	}
-	std::cout << "Getting bytes to return for " << fileName << std::endl;
-	//Returns specified file as a vector of bytes
-	try {
-		std::ifstream file(getPath() + fileName, std::ios::binary);
-		file.unsetf(std::ios::skipws);
-
-		std::streampos fileSize;
-		file.seekg(0, std::ios::end);
-		fileSize = file.tellg();
-		file.seekg(0, std::ios::beg);
-		std::vector<uint8_t> bytes;
-		bytes.reserve(unsigned int(fileSize));
-		bytes.insert(bytes.begin(),
-			std::istream_iterator<uint8_t>(file),
-			std::istream_iterator<uint8_t>());
-		//return std::pair<std::vector<uint8_t>, std::array<int, 2>>(bytes, std::array<int, 2>({ version, master }));
-		getClient(sender)->async_call("receive", fileName, bytes, version, master);
-	}
-	catch (...) {
+	std::ifstream file(getPath() + nameOf(fileId), std::ios::binary | std::ios::ate);
+	long long fileSize = file ? (long long)file.tellg() : -1;
+	if (fileSize < 0) {
 		metricLock.lock();
 		invalid++;
 		metricLock.unlock();
-		rpc::this_handler().respond_error("Error reading file");
-		return;
+		respondError("Error reading file");
+		return {};
 	}
+	return std::tuple<int, int, long long, long long>(version, master, fileSize, leaseMs);
 }
 
-void receive(std::string fileName, std::vector<uint8_t> bytes, int version, int masterId) {
+std::vector<uint8_t> Leaf::obtainChunk(FileId fileId, long long offset) {
+	//Returns up to CHUNK_SIZE bytes of the file starting at offset
 	versionLock.lock();
+	bool stale = invalidFiles.find(fileId) != invalidFiles.end();
+	versionLock.unlock();
+	if (stale) {
+		respondError("File out of date");
+		return {};
+	}
+	std::ifstream file(getPath() + nameOf(fileId), std::ios::binary);
+	if (!file) {
+		respondError("Error reading file");
+		return {};
+	}
+	file.seekg(offset);
+	std::vector<uint8_t> bytes(CHUNK_SIZE);
+	file.read((char *)bytes.data(), CHUNK_SIZE);
+	bytes.resize(size_t(file.gcount()));
+	return bytes;
+}
+
+void Leaf::receive(FileId fileId, int version, int masterId, long long leaseMs) {
+	//Records a file that transferFile has finished writing to disk
+	versionLock.lock();
+	if (lease) {
+		leases[fileId] = { std::chrono::steady_clock::now() + std::chrono::milliseconds(leaseMs), {} };
+	}
 	bool isValid = false;
 	bool fresh = false;
-	if (invalidFiles.find(fileName) == invalidFiles.end()) {
+	if (invalidFiles.find(fileId) == invalidFiles.end()) {
 		isValid = true;
 	}
-	if (retrievedFiles.find(fileName) == retrievedFiles.end()) {
+	if (retrievedFiles.find(fileId) == retrievedFiles.end()) {
 		fresh = true;
 	}
-	printlock.lock();
-	std::cout << "Downloaded " << fileName << std::endl;
-	printlock.unlock();
-	if (fresh || !isValid) {
-		//Copy downloaded file
-		std::ofstream destination(getPath() + fileName, std::ios::binary);
-		destination.write((char *)bytes.data(), bytes.size());
-		if (fresh) {
-			//Add file to file records
-			retrievedFiles.insert({ fileName, std::array<int, 2>({ version, masterId }) });
-			superClient->call("add", id, fileName, version);
-			//Decrement pending query count
-			queryCount.lock();
-			pendingQueries--;
-			queryCount.unlock();
-			//Increment valid counter
-			metricLock.lock();
-			valid++;
-			metricLock.unlock();
-			ready.notify_one();
-		}
-		if (!isValid) {
-			//Revalidate file locally
-			invalidFiles.erase(fileName);
-			printlock.lock();
-			std::cout << "revalidated " << fileName << std::endl;
-			printlock.unlock();
+	LOG_DEBUG("Downloaded " << nameOf(fileId));
+	if (fresh) {
+		//Add file to file records
+		retrievedFiles.insert({ fileId, std::array<int, 2>({ version, masterId }) });
+		if (Trace::enabled()) {
+			Trace::downloaded(id, fileId);
 		}
+		queueAdd(fileId, version);
+		//Count it before settling, since settling the last query lets the main thread report metrics
+		metricLock.lock();
+		valid++;
+		metricLock.unlock();
+		settleQuery(fileId, true);
+	}
+	if (!isValid) {
+		//Revalidate file locally and let the super know which version we hold now
+		retrievedFiles[fileId] = std::array<int, 2>({ version, masterId });
+		queueAdd(fileId, version);
+		invalidFiles.erase(fileId);
+		LOG_DEBUG("revalidated " << nameOf(fileId));
 	}
 	versionLock.unlock();
-	printlock.lock();
-	std::cout << "Pending: " << pendingQueries << std::endl;
-	printlock.unlock();
+	LOG_DEBUG("Pending: " << pendingQueries);
+}
+
+void Leaf::registerFiles(const std::vector<Registration> &files) {
+	//Registers files with the super, ADD_BATCH_SIZE per message
+	for (size_t first = 0; first < files.size(); first += ADD_BATCH_SIZE) {
+		std::vector<Registration> batch(files.begin() + first, files.begin() + std::min(files.size(), first + ADD_BATCH_SIZE));
+		try {
+			std::vector<std::string> rejected = Stats::call(superClient, "addBatch", id, batch).as<std::vector<std::string>>();
+			for (const std::string &fileName : rejected) {
+				LOG_WARN("Couldn't register " << fileName << ": File ID collision");
+			}
+		}
+		catch (RemoteError &e) {
+			LOG_WARN("Couldn't register " << batch.size() << " files: " << e.what());
+		}
+	}
+}
+
+void Leaf::queueAdd(FileId fileId, int version) {
+	//Hands a registration to the registrar so receive doesn't wait on the super
+	addLock.lock();
+	int &queued = pendingAdds.insert({ fileId, version }).first->second;
+	queued = std::max(queued, version);
+	bool startRegistrar = !registering;
+	registering = true;
+	addLock.unlock();
+	if (startRegistrar) {
+		runInBackground([this] { registrar(); });
+	}
+}
+
+void Leaf::registrar() {
+	//Sends queued registrations until none are left; whatever piles up while a batch is in flight goes in
+	//the next one. Only one of these runs at a time
+	std::unique_lock<std::mutex> unique(addLock);
+	while (true) {
+		if (pendingAdds.empty()) {
+			registering = false;
+			addReady.notify_all();
+			return;
+		}
+		std::unordered_map<FileId, int> queued;
+		queued.swap(pendingAdds);
+		unique.unlock();
+		std::vector<Registration> files;
+		files.reserve(queued.size());
+		for (const auto &entry : queued) {
+			files.push_back({ nameOf(entry.first), entry.second });
+		}
+		registerFiles(files);
+		unique.lock();
+	}
 }
 
-bool upToDate(std::string fileName, int version) {
-	printlock.lock();
-	std::cout << "Someone is asking about version " << version << " of " << fileName << std::endl;
-	printlock.unlock();
-	auto ownIter = ownFiles.find(fileName);
+bool Leaf::upToDate(FileId fileId, int version) {
+	LOG_DEBUG("Someone is asking about version " << version << " of " << nameOf(fileId));
+	auto ownIter = ownFiles.find(fileId);
 	if (ownIter != ownFiles.end()) {
 		return ownIter->second <= version;
 	}
 	return true;
 }
 
-rpc::client* getClient(int clientId) {
-	//Return a client for clientId
-	auto leafIter = leafClients.find(clientId);
-	if (leafIter != leafClients.end()) {
-		//std::cout << "leaf" << std::endl;
-		return leafIter->second;
+std::shared_ptr<Client> Leaf::getClient(int clientId) {
+	//Return a pooled client for clientId, safe to call from any thread
+	return peers.get(clientId);
+}
+
+std::array<long long, 5> Leaf::connectionStats() {
+	return peers.stats();
+}
+
+
+void Leaf::sendQueries(int TTL, const std::vector<QueryEntry> &batch) {
+	//Registers each query's timers and sends the batch to our super. pendingQueries counts the
+	//outstandingQueries entries, so both are keyed by file
+	auto now = std::chrono::steady_clock::now();
+	queryCount.lock();
+	for (auto &entry : batch) {
+		auto inserted = outstandingQueries.insert({ entry.second, OutstandingQuery() });
+		OutstandingQuery &query = inserted.first->second;
+		if (inserted.second) {
+			pendingQueries++;
+			query.deadline = std::chrono::steady_clock::time_point::max();
+		}
+		//The deadline runs from the first attempt at the full TTL, so every ring before it gets sent
+		if (TTL >= startTTL && query.deadline == std::chrono::steady_clock::time_point::max()) {
+			query.deadline = now + std::chrono::milliseconds(QUERY_DEADLINE_MS);
+		}
+		query.TTL = TTL;
+		query.answered = false;
+		//Give each ring time for a round trip before widening; a full flood just waits for its deadline
+		query.retryAt = expandingRing && TTL < startTTL ? now + std::chrono::milliseconds(QUERY_RING_STEP_MS * TTL) : query.deadline;
 	}
-	//If the client doesn't exist yet make a new one
-	rpc::client *client = new rpc::client("localhost", 8000 + clientId);
-	leafClients.insert({ clientId, client });
-	//TODO: sometimes the insertion doesnt actually happen and causes total failure o_O
-	return client;
+	queryCount.unlock();
+	if (Trace::enabled()) {
+		for (auto &entry : batch) {
+			Trace::querySent(entry.first, entry.second);
+		}
+	}
+	Stats::asyncCall(superClient, "queryBatch", id, TTL, batch);
 }
 
+void Leaf::retryQueries() {
+	//Fails queries past their deadline and resends the ones due for a wider ring, grouped by TTL
+	auto now = std::chrono::steady_clock::now();
+	std::map<int, std::vector<QueryEntry>> retries;
+	std::vector<FileId> expired;
+	queryCount.lock();
+	for (auto &entry : outstandingQueries) {
+		OutstandingQuery &query = entry.second;
+		if (query.answered) {
+			continue;
+		}
+		if (now >= query.deadline) {
+			expired.push_back(entry.first);
+		}
+		else if (now >= query.retryAt) {
+			int TTL = expandingRing ? std::min(query.TTL + 1, startTTL) : startTTL;
+			retries[TTL].push_back(QueryEntry({ id, nextMessageId++ }, entry.first));
+			query.retryAt = query.deadline;
+		}
+	}
+	queryCount.unlock();
+	for (FileId fileId : expired) {
+		LOG_DEBUG("Giving up on " << nameOf(fileId));
+		settleQuery(fileId, false);
+	}
+	for (auto &retry : retries) {
+		LOG_DEBUG("Retrying " << retry.second.size() << " queries with TTL " << retry.first);
+		sendQueries(retry.first, retry.second);
+	}
+}
+
+void Leaf::settleQuery(FileId fileId, bool found) {
+	//Takes a query off the pending count once, whether it was answered or ran out of time
+	queryCount.lock();
+	if (outstandingQueries.erase(fileId) > 0) {
+		pendingQueries--;
+		if (!found) {
+			failedQueries++;
+		}
+	}
+	queryCount.unlock();
+	ready.notify_one();
+}
 
-void start() {
+std::tuple<long long, long long> Leaf::renewLease(FileId fileId, int version) {
+	//Handler run on the master. Returns (new lease ms, micros when the holder's version was superseded
+	//or -1 if it is still current)
+	versionLock.lock();
+	auto ownIter = ownFiles.find(fileId);
+	if (ownIter == ownFiles.end()) {
+		versionLock.unlock();
+		respondError("Not the master of this file");
+		return {};
+	}
+	long long staleSince = -1;
+	if (version < ownIter->second) {
+		const auto &madeAt = updateHistories[fileId].madeAt;
+		auto next = madeAt.upper_bound(version);
+		staleSince = next == madeAt.end() ? 0 : next->second;
+	}
+	long long leaseMs = leaseFor(fileId);
+	versionLock.unlock();
+	return std::tuple<long long, long long>(leaseMs, staleSince);
+}
+
+long long Leaf::leaseFor(FileId fileId) {
+	//Caller holds versionLock. Leases last a share of the mean time between updates, so files that change
+	//often are revalidated often and quiet ones are left alone
+	const auto history = updateHistories.find(fileId);
+	if (history == updateHistories.end() || history->second.meanIntervalMs <= 0) {
+		return LEASE_INITIAL_MS;
+	}
+	long long leaseMs = (long long)(history->second.meanIntervalMs * LEASE_UPDATE_SHARE);
+	return std::max<long long>(LEASE_MIN_MS, std::min<long long>(LEASE_MAX_MS, leaseMs));
+}
+
+void Leaf::recordUpdate(FileId fileId, int version) {
+	versionLock.lock();
+	UpdateHistory &history = updateHistories[fileId];
+	long long now = Trace::now();
+	if (!history.madeAt.empty()) {
+		double intervalMs = (now - history.madeAt.rbegin()->second) / 1000.0;
+		history.meanIntervalMs = history.meanIntervalMs <= 0 ? intervalMs : history.meanIntervalMs * (1 - LEASE_SMOOTHING) + intervalMs * LEASE_SMOOTHING;
+	}
+	history.madeAt[version] = now;
+	versionLock.unlock();
+}
+
+void Leaf::auditLeases(bool all) {
+	//Renews expired leases on copies served since their last renewal (every such copy if all is set), so
+	//stale serves are counted without waiting for the next request. One audit runs at a time
+	std::lock_guard<std::mutex> auditing(auditLock);
+	auto now = std::chrono::steady_clock::now();
+	std::vector<std::tuple<FileId, int, int>> due; // (fileId, version, master)
+	versionLock.lock();
+	for (auto &held : leases) {
+		if (!held.second.servedAt.empty() && (all || held.second.expires <= now) && invalidFiles.find(held.first) == invalidFiles.end()) {
+			auto retrievedIter = retrievedFiles.find(held.first);
+			if (retrievedIter != retrievedFiles.end()) {
+				due.push_back(std::make_tuple(held.first, retrievedIter->second[0], retrievedIter->second[1]));
+			}
+		}
+	}
+	versionLock.unlock();
+	for (auto &entry : due) {
+		renewHeldLease(std::get<0>(entry), std::get<1>(entry), std::get<2>(entry));
+	}
+}
+
+bool Leaf::renewHeldLease(FileId fileId, int version, int master) {
+	//Asks the master to renew the lease on a copy we hold, and returns whether the copy is still current.
+	//Serves made after the master's next update were stale and count as invalid, and a stale copy is
+	//replaced from the master
+	std::tuple<long long, long long> renewal;
+	try {
+		renewal = Stats::call(getClient(master), "renewLease", fileId, version).as<std::tuple<long long, long long>>();
+	}
+	catch (std::exception &e) {
+		LOG_WARN("Couldn't renew the lease on " << nameOf(fileId) << ": " << e.what());
+		return false;
+	}
+	long long staleSince = std::get<1>(renewal);
+	int staleServes = 0;
+	versionLock.lock();
+	Lease &held = leases[fileId];
+	if (staleSince >= 0) {
+		for (long long servedAt : held.servedAt) {
+			if (servedAt >= staleSince) {
+				staleServes++;
+			}
+		}
+		invalidFiles.insert(fileId);
+		held.expires = std::chrono::steady_clock::now();
+	}
+	else {
+		held.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::get<0>(renewal));
+	}
+	held.servedAt.clear();
+	versionLock.unlock();
+	if (staleSince >= 0) {
+		LOG_DEBUG("Lease on " << nameOf(fileId) << " ended stale after " << staleServes << " stale serves");
+		metricLock.lock();
+		invalid += staleServes;
+		metricLock.unlock();
+		queueDownload({ master }, fileId);
+		return false;
+	}
+	return true;
+}
+
+void Leaf::leaseLoop() {
+	//Timer job that renews expired leases on served copies every LEASE_AUDIT_MS, until the run ends
+	if (canEnd) {
+		return;
+	}
+	auditLeases(false);
+	runAfter(std::chrono::milliseconds(LEASE_AUDIT_MS), [this] { leaseLoop(); });
+}
+
+std::chrono::steady_clock::time_point Leaf::nextQueryTimer() {
+	//Earliest retry or deadline among unanswered queries
+	auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(QUERY_TIMER_MAX_MS);
+	queryCount.lock();
+	for (auto &entry : outstandingQueries) {
+		if (!entry.second.answered) {
+			next = std::min(next, std::min(entry.second.retryAt, entry.second.deadline));
+		}
+	}
+	queryCount.unlock();
+	return next;
+}
+
+void Leaf::start() {
 	canStart = true;
 	ready.notify_one();
 }
 
-void end() {
+void Leaf::startAll(int last) {
+	//Starts leaves id to last - 1, which have consecutive IDs. Each round hands the upper half of what is
+	//left to that half's first leaf, so the start reaches n leaves in about log2(n) hops
+	int count = last - id;
+	while (count > 1) {
+		int half = count / 2;
+		int target = id + count - half;
+		Stats::asyncCall(getClient(target), "startAll", target + half);
+		count -= half;
+	}
+	start();
+}
+
+void Leaf::end() {
 	canEnd = true;
 	ready.notify_one();
 }
 
-std::string getPath() {
+std::string Leaf::getPath() {
 	return "Leaves/Leaf " + std::to_string(id) + "/";
-}
\ No newline at end of file
+}
+
+void Leaf::makeDirectory(const std::string &path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+bool Leaf::internName(const std::string &fileName, FileId &fileId) {
+	//Remember the name behind a file ID; returns false if another name already has the ID
+	fileId = fileIdOf(fileName);
+	nameLock.lock();
+	auto nameEntry = fileNames.find(fileId);
+	if (nameEntry == fileNames.end()) {
+		fileNames.insert({ fileId, fileName });
+		nameLock.unlock();
+		return true;
+	}
+	std::string existing = nameEntry->second;
+	nameLock.unlock();
+	if (existing != fileName) {
+		LOG_WARN("File ID collision between " << fileName << " and " << existing << ", skipping it");
+		return false;
+	}
+	return true;
+}
+
+std::string Leaf::nameOf(FileId fileId) {
+	nameLock.lock();
+	auto nameEntry = fileNames.find(fileId);
+	std::string fileName = nameEntry == fileNames.end() ? std::to_string(fileId) : nameEntry->second;
+	nameLock.unlock();
+	return fileName;
+}
@@ -1,54 +1,615 @@
-#include "rpc/server.h"
-#include "rpc/client.h"
-#include "rpc/rpc_error.h"
-#include "rpc/this_server.h"
+#include "../Common/Transport.h"
+#include "../Common/Bootstrap.h"
+#include "../Common/ConnectionPool.h"
+#include "../Common/FileId.h"
+#include "../Common/Log.h"
+#include "../Common/Stats.h"
+#include "../Common/Trace.h"
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <string>
 #include <array>
 #include <unordered_map>
-#include <map>
 #include <unordered_set>
-#include <set>
 #include <algorithm>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <tuple>
+#include <list>
+#include <deque>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-void query(int sender, std::array<int, 2> messageId, int TTL, std::string fileName);
-void queryHit(int sender, std::array<int, 2> messageId, int TTL, std::string fileName, std::vector<int> leaves);
-void invalidate(std::array<int, 2> messageId, int masterId, int TTL, std::string fileName, int versionNumber);
-void add(int leafId, std::string fileName, int version);
-rpc::client* getClient(int id);
-void leafReady();
-void end();
-void ping();
-void dumpIndex();
-void updateVersion(int leafId, std::string fileName, int version);
-void checkVersion(int sender, std::string fileName, int version);
-void fileOutOfDate(std::string fileName, int versionNumber);
-
-int id, nSupers, nChildren, startTTL;
-bool push = false, pull1 = false, pull2 = false;
-std::unordered_map<int, rpc::client*> neighborClients;
-std::unordered_map<int, rpc::client*> leafClients;
-
-std::unordered_map<std::string, std::vector<int>> fileIndex;
-std::unordered_map<std::string, std::unordered_map<int, std::pair<int,bool>>> fileVersionIndex; // fileName -> {leafID -> (version,isValid)}
-//std::unordered_map<std::string, std::vector<int>> invalidFiles;
-std::map<std::array<int, 2>, std::unordered_set<int>> queryHistory;
-std::set<std::array<int, 2>> invalidateHistory;
-
-int readyCount = 0;
-bool canEnd;
-std::mutex countLock;
-std::mutex historyLock;
-std::mutex invalidateLock;
-std::mutex indexLock;
-std::mutex waitLock;
-std::mutex printlock;
-std::condition_variable ready;
+#define INDEX_SHARDS 64
+#define HISTORY_GENERATIONS 4
+#define HISTORY_PERIOD_MS 5000
+#define HISTORY_GENERATION_CAPACITY 65536
+#define HISTORY_GENERATION_LIMIT (4 * HISTORY_GENERATION_CAPACITY)
+#define SUMMARY_BITS (1 << 16)
+#define SUMMARY_HASHES 4
+#define SUMMARY_DEPTH 3
+#define SUMMARY_PERIOD_MS 500
+#define QUERY_CACHE_CAPACITY 4096
+#define QUERY_CACHE_TTL_MS 10000
+#define QUERY_CACHE_NEGATIVE_AFTER_MS 2000
+#define QUERY_CACHE_NEGATIVE_TTL_MS 3000
+#define SNAPSHOT_MAGIC "GIDX"
+#define SNAPSHOT_FORMAT 1
+#define SNAPSHOT_PERIOD_MS 5000
 
+struct IndexShard {
+	std::shared_timed_mutex lock;
+	std::unordered_map<FileId, std::vector<int>> fileIndex;
+	std::unordered_map<FileId, std::unordered_map<int, std::pair<int, bool>>> fileVersionIndex; // fileId -> {leafID -> (version,isValid)}
+	std::unordered_map<FileId, int> newestVersions; // fileId -> newest version seen here or reported by neighbors
+	std::unordered_map<FileId, std::string> fileNames; // fileId -> name it was registered under
+	std::unordered_set<FileId> faulted; // files whose snapshot entries are already merged in
+};
+
+//Bloom filter over file IDs, used to summarize which files a super (or the supers behind it) index
+class BloomFilter {
+public:
+	BloomFilter() : words(SUMMARY_BITS / 64, 0) {}
+	explicit BloomFilter(std::vector<uint64_t> bits) : words(std::move(bits)) {
+		words.resize(SUMMARY_BITS / 64, 0);
+	}
+
+	//Returns true if any bit changed
+	bool add(FileId key) {
+		bool changed = false;
+		uint64_t h1, h2;
+		hash(key, h1, h2);
+		for (int i = 0; i < SUMMARY_HASHES; i++) {
+			uint64_t bit = (h1 + i * h2) % SUMMARY_BITS;
+			uint64_t mask = uint64_t(1) << (bit % 64);
+			changed |= (words[bit / 64] & mask) == 0;
+			words[bit / 64] |= mask;
+		}
+		return changed;
+	}
+
+	bool mightContain(FileId key) const {
+		uint64_t h1, h2;
+		hash(key, h1, h2);
+		for (int i = 0; i < SUMMARY_HASHES; i++) {
+			uint64_t bit = (h1 + i * h2) % SUMMARY_BITS;
+			if ((words[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void merge(const BloomFilter &other) {
+		for (size_t i = 0; i < words.size(); i++) {
+			words[i] |= other.words[i];
+		}
+	}
+
+	bool operator==(const BloomFilter &other) const {
+		return words == other.words;
+	}
+
+	std::vector<uint64_t> words;
+
+private:
+	static void hash(FileId key, uint64_t &h1, uint64_t &h2) {
+		//The ID is already a hash of the name; a mixed copy of it is the second hash for double hashing
+		uint64_t h = key;
+		h1 = h;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h2 = h | 1;
+	}
+};
+
+//LRU cache of remote queryHit results. A file we forwarded a query for without getting a hit back
+//within QUERY_CACHE_NEGATIVE_AFTER_MS is cached as missing for QUERY_CACHE_NEGATIVE_TTL_MS, but only
+//for queries reaching no further than that forward did, so a widened search still goes out.
+//Callers provide their own locking.
+class QueryCache {
+public:
+	enum Result { MISS, HIT, NEGATIVE };
+
+	QueryCache() : hits(0), negativeHits(0), misses(0) {}
+
+	Result lookup(FileId fileId, std::vector<int> &holders, int TTL) {
+		auto now = std::chrono::steady_clock::now();
+		auto entry = entries.find(fileId);
+		if (entry == entries.end()) {
+			misses++;
+			return MISS;
+		}
+		auto age = now - entry->second.stamp;
+		if (!entry->second.holders.empty() && age < std::chrono::milliseconds(QUERY_CACHE_TTL_MS)) {
+			lru.splice(lru.begin(), lru, entry->second.position);
+			holders = entry->second.holders;
+			hits++;
+			return HIT;
+		}
+		if (entry->second.holders.empty() && entry->second.reach >= TTL && age >= std::chrono::milliseconds(QUERY_CACHE_NEGATIVE_AFTER_MS)
+			&& age < std::chrono::milliseconds(QUERY_CACHE_NEGATIVE_AFTER_MS + QUERY_CACHE_NEGATIVE_TTL_MS)) {
+			negativeHits++;
+			return NEGATIVE;
+		}
+		if (entry->second.holders.empty() && (entry->second.reach < TTL || age < std::chrono::milliseconds(QUERY_CACHE_NEGATIVE_AFTER_MS))) {
+			//Still waiting on the forwarded query, or it didn't reach as far as this one will
+			misses++;
+			return MISS;
+		}
+		erase(fileId);
+		misses++;
+		return MISS;
+	}
+
+	//Start the negative-entry clock for a file we just forwarded a query with this TTL for
+	void noteForwarded(FileId fileId, int TTL) {
+		auto entry = entries.find(fileId);
+		if (entry == entries.end()) {
+			insert(fileId, {}, TTL);
+		}
+		else if (entry->second.holders.empty() && entry->second.reach < TTL) {
+			//A wider search restarts the clock
+			entry->second.reach = TTL;
+			entry->second.stamp = std::chrono::steady_clock::now();
+		}
+	}
+
+	void store(FileId fileId, const std::vector<int> &holders) {
+		auto entry = entries.find(fileId);
+		if (entry != entries.end() && !entry->second.holders.empty()
+			&& std::chrono::steady_clock::now() - entry->second.stamp < std::chrono::milliseconds(QUERY_CACHE_TTL_MS)) {
+			//Merge holders from several hits for the same file
+			for (int holder : holders) {
+				if (std::find(entry->second.holders.begin(), entry->second.holders.end(), holder) == entry->second.holders.end()) {
+					entry->second.holders.push_back(holder);
+				}
+			}
+			return;
+		}
+		erase(fileId);
+		insert(fileId, holders);
+	}
+
+	void erase(FileId fileId) {
+		auto entry = entries.find(fileId);
+		if (entry != entries.end()) {
+			lru.erase(entry->second.position);
+			entries.erase(entry);
+		}
+	}
+
+	long long hits, negativeHits, misses;
+
+private:
+	struct Entry {
+		std::vector<int> holders;
+		int reach; //TTL of the widest forward a negative entry stands for
+		std::chrono::steady_clock::time_point stamp;
+		std::list<FileId>::iterator position;
+	};
+
+	void insert(FileId fileId, const std::vector<int> &holders, int reach = 0) {
+		if (entries.size() >= QUERY_CACHE_CAPACITY) {
+			entries.erase(lru.back());
+			lru.pop_back();
+		}
+		lru.push_front(fileId);
+		entries[fileId] = { holders, reach, std::chrono::steady_clock::now(), lru.begin() };
+	}
+
+	std::unordered_map<FileId, Entry> entries;
+	std::list<FileId> lru;
+};
+
+//Neighbors we sent queryHits to, per file, for as long as their QueryCache may keep the holders. An
+//invalidation for the file has to reach them even when their summaries don't hold it, or their cache
+//keeps handing out stale holders. Once QUERY_CACHE_CAPACITY files are tracked, the files noted first are
+//dropped until there is room and the earliest one left hasn't expired. Callers provide their own locking.
+class HitRecipients {
+public:
+	void note(FileId fileId, int neighborId) {
+		auto now = std::chrono::steady_clock::now();
+		auto entry = entries.find(fileId);
+		if (entry == entries.end()) {
+			if (entries.size() >= QUERY_CACHE_CAPACITY) {
+				sweep(now);
+			}
+			order.push_back(fileId);
+			entry = entries.insert({ fileId, {} }).first;
+		}
+		entry->second[neighborId] = now;
+	}
+
+	//Returns the neighbors that may still cache holders of fileId and forgets them, since the
+	//invalidation about to reach them clears their entry
+	std::vector<int> take(FileId fileId) {
+		std::vector<int> neighbors;
+		auto entry = entries.find(fileId);
+		if (entry == entries.end()) {
+			return neighbors;
+		}
+		auto now = std::chrono::steady_clock::now();
+		for (auto &neighbor : entry->second) {
+			if (now - neighbor.second < std::chrono::milliseconds(QUERY_CACHE_TTL_MS)) {
+				neighbors.push_back(neighbor.first);
+			}
+		}
+		entries.erase(entry);
+		return neighbors;
+	}
+
+private:
+	void sweep(std::chrono::steady_clock::time_point now) {
+		//Files are dropped from order lazily, once their entry is gone
+		while (!order.empty()) {
+			auto entry = entries.find(order.front());
+			if (entry != entries.end()) {
+				bool expired = true;
+				for (auto &neighbor : entry->second) {
+					expired &= now - neighbor.second >= std::chrono::milliseconds(QUERY_CACHE_TTL_MS);
+				}
+				if (!expired && entries.size() < QUERY_CACHE_CAPACITY) {
+					break;
+				}
+				entries.erase(entry);
+			}
+			order.pop_front();
+		}
+	}
+
+	std::unordered_map<FileId, std::unordered_map<int, std::chrono::steady_clock::time_point>> entries;
+	std::deque<FileId> order; // files in the order they were first noted
+};
+
+//Message dedup table made of a ring of hash tables. New entries go in the newest generation and the
+//oldest one is dropped every HISTORY_PERIOD_MS. Once the newest holds HISTORY_GENERATION_CAPACITY
+//entries the ring turns early, but only if the oldest generation's last entry is already
+//(HISTORY_GENERATIONS - 1) periods old, so entries for in-flight messages always live that long and
+//under heavy load the newest generation grows past its capacity instead. At HISTORY_GENERATION_LIMIT
+//entries it turns regardless, so a burst shortens how long duplicates are caught rather than growing
+//the table without bound. Callers provide their own locking.
+template <typename T>
+class MessageHistory {
+public:
+	MessageHistory() : current(0), evicted(0) {
+		startedAt.fill(std::chrono::steady_clock::now());
+	}
+
+	//Returns the entry for messageId, creating it if needed. isNew reports whether it was created
+	T &touch(std::array<int, 2> messageId, bool &isNew) {
+		rotateIfDue();
+		T *existing = find(messageId);
+		isNew = existing == nullptr;
+		if (isNew) {
+			return generations[current][key(messageId)];
+		}
+		return *existing;
+	}
+
+	T *find(std::array<int, 2> messageId) {
+		uint64_t messageKey = key(messageId);
+		for (int age = 0; age < HISTORY_GENERATIONS; age++) {
+			auto &generation = generations[(current + HISTORY_GENERATIONS - age) % HISTORY_GENERATIONS];
+			auto entry = generation.find(messageKey);
+			if (entry != generation.end()) {
+				return &entry->second;
+			}
+		}
+		return nullptr;
+	}
+
+	long long evictions() const {
+		return evicted;
+	}
+
+	long long size() const {
+		long long total = 0;
+		for (auto &generation : generations) {
+			total += generation.size();
+		}
+		return total;
+	}
+
+private:
+	static uint64_t key(std::array<int, 2> messageId) {
+		return (uint64_t(uint32_t(messageId[0])) << 32) | uint32_t(messageId[1]);
+	}
+
+	void rotateIfDue() {
+		auto now = std::chrono::steady_clock::now();
+		int oldest = (current + 1) % HISTORY_GENERATIONS;
+		bool periodOver = now - startedAt[current] >= std::chrono::milliseconds(HISTORY_PERIOD_MS);
+		bool full = generations[current].size() >= HISTORY_GENERATION_CAPACITY;
+		bool overLimit = generations[current].size() >= HISTORY_GENERATION_LIMIT;
+		//The oldest generation took entries until the one after it started
+		bool oldestExpired = now - startedAt[(oldest + 1) % HISTORY_GENERATIONS] >= std::chrono::milliseconds(HISTORY_PERIOD_MS * (HISTORY_GENERATIONS - 1));
+		if (!periodOver && !(full && oldestExpired) && !overLimit) {
+			return;
+		}
+		current = oldest;
+		evicted += generations[current].size();
+		generations[current].clear();
+		startedAt[current] = now;
+	}
+
+	std::array<std::unordered_map<uint64_t, T>, HISTORY_GENERATIONS> generations;
+	std::array<std::chrono::steady_clock::time_point, HISTORY_GENERATIONS> startedAt;
+	int current;
+	long long evicted;
+};
+
+//One (file, leaf) entry of a snapshot or delta log
+struct IndexRecord {
+	uint64_t fileId;
+	int32_t leafId;
+	int32_t version;
+	uint32_t valid;
+	uint32_t reserved;
+
+	bool operator<(const IndexRecord &other) const {
+		return fileId < other.fileId || (fileId == other.fileId && leafId < other.leafId);
+	}
+};
+
+//Snapshot layout: this header, then the records sorted by file and leaf
+struct SnapshotHeader {
+	char magic[4];
+	uint32_t format;
+	uint64_t sequence; //Higher in each snapshot written, so the newer of the two slots wins
+	uint64_t records;
+	uint64_t summary[SUMMARY_BITS / 64]; //Bloom summary of the files, so neighbors can route to us at once
+};
+
+//Read-only, memory-mapped index snapshot. Entries are found by binary search in the mapping, so opening
+//one costs the same however many files it holds
+class IndexSnapshot {
+public:
+	~IndexSnapshot() {
+		//Releases whatever open got as far as acquiring
+#ifdef _WIN32
+		if (data != nullptr) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping != nullptr) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+#else
+		if (data != nullptr) {
+			munmap((void *)data, length);
+		}
+#endif
+	}
+
+	//Returns nullptr if path is missing or isn't a complete snapshot
+	static std::shared_ptr<IndexSnapshot> open(const std::string &path) {
+		std::shared_ptr<IndexSnapshot> snapshot(new IndexSnapshot());
+#ifdef _WIN32
+		snapshot->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if (snapshot->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(snapshot->file, &size) || size.QuadPart < (LONGLONG)sizeof(SnapshotHeader)) {
+			return nullptr;
+		}
+		snapshot->length = (size_t)size.QuadPart;
+		snapshot->mapping = CreateFileMappingA(snapshot->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (snapshot->mapping == nullptr) {
+			return nullptr;
+		}
+		snapshot->data = (const char *)MapViewOfFile(snapshot->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (snapshot->data == nullptr) {
+			return nullptr;
+		}
+#else
+		int descriptor = ::open(path.c_str(), O_RDONLY);
+		struct stat status;
+		if (descriptor < 0 || fstat(descriptor, &status) != 0 || status.st_size < (off_t)sizeof(SnapshotHeader)) {
+			if (descriptor >= 0) {
+				close(descriptor);
+			}
+			return nullptr;
+		}
+		snapshot->length = (size_t)status.st_size;
+		void *mapped = mmap(nullptr, snapshot->length, PROT_READ, MAP_SHARED, descriptor, 0);
+		close(descriptor);
+		if (mapped == MAP_FAILED) {
+			return nullptr;
+		}
+		snapshot->data = (const char *)mapped;
+#endif
+		const SnapshotHeader *header = snapshot->header();
+		if (std::memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->format != SNAPSHOT_FORMAT
+			|| snapshot->length != sizeof(SnapshotHeader) + header->records * sizeof(IndexRecord)) {
+			LOG_WARN("Ignoring damaged index snapshot " << path);
+			return nullptr;
+		}
+		return snapshot;
+	}
+
+	//Writes sorted records to path. Callers write into the slot that isn't mapped, so a snapshot is never
+	//replaced while in use, and one cut short by a crash fails the size check and loses to the other slot
+	static bool write(const std::string &path, uint64_t sequence, const std::vector<IndexRecord> &records, const BloomFilter &summary) {
+		SnapshotHeader header = {};
+		std::memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+		header.format = SNAPSHOT_FORMAT;
+		header.sequence = sequence;
+		header.records = records.size();
+		std::copy(summary.words.begin(), summary.words.end(), header.summary);
+		//A fresh file, so a mapping still open on the old one keeps its pages
+		std::remove(path.c_str());
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write((const char *)&header, sizeof(header));
+		out.write((const char *)records.data(), records.size() * sizeof(IndexRecord));
+		out.close();
+		return !out.fail();
+	}
+
+	const IndexRecord *begin() const {
+		return (const IndexRecord *)(data + sizeof(SnapshotHeader));
+	}
+
+	const IndexRecord *end() const {
+		return begin() + header()->records;
+	}
+
+	//Entries for fileId, empty if the snapshot doesn't hold it
+	std::pair<const IndexRecord *, const IndexRecord *> find(FileId fileId) const {
+		return std::equal_range(begin(), end(), IndexRecord{ fileId, 0, 0, 0, 0 }, [](const IndexRecord &a, const IndexRecord &b) {
+			return a.fileId < b.fileId;
+		});
+	}
+
+	BloomFilter summary() const {
+		return BloomFilter(std::vector<uint64_t>(header()->summary, header()->summary + SUMMARY_BITS / 64));
+	}
+
+	size_t size() const {
+		return (size_t)header()->records;
+	}
+
+	uint64_t sequence() const {
+		return header()->sequence;
+	}
+
+private:
+#ifdef _WIN32
+	IndexSnapshot() : data(nullptr), length(0), file(INVALID_HANDLE_VALUE), mapping(nullptr) {}
+#else
+	IndexSnapshot() : data(nullptr), length(0) {}
+#endif
+
+	const SnapshotHeader *header() const {
+		return (const SnapshotHeader *)data;
+	}
+
+	const char *data;
+	size_t length;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+typedef std::pair<std::array<int, 2>, FileId> QueryEntry; // (messageId, fileId)
+typedef std::tuple<std::array<int, 2>, FileId, std::vector<int>> HitEntry; // (messageId, fileId, leaves)
+typedef std::pair<FileId, int> VersionEntry; // (fileId, newest version)
+typedef std::pair<std::string, int> Registration; // (file name, version)
+
+class SuperPeer {
+public:
+	int run(int argc, char* argv[]);
+
+private:
+	void query(int sender, std::array<int, 2> messageId, int TTL, FileId fileId);
+	void queryBatch(int sender, int TTL, std::vector<QueryEntry> queries);
+	void queryHit(int sender, std::array<int, 2> messageId, int TTL, FileId fileId, std::vector<int> leaves);
+	void queryHitBatch(int sender, int TTL, std::vector<HitEntry> hits);
+	void invalidate(std::array<int, 2> messageId, int masterId, int TTL, FileId fileId, int versionNumber);
+	void add(int leafId, std::string fileName, int version);
+	std::vector<std::string> addBatch(int leafId, std::vector<Registration> files);
+	std::shared_ptr<Client> getClient(int id);
+	std::array<long long, 5> connectionStats();
+	IndexShard &shardFor(FileId fileId);
+	void leafReady(int leafId);
+	void end();
+	void ping();
+	void dumpIndex();
+	std::array<long long, 4> historyStats();
+	void updateVersion(int leafId, FileId fileId, int version);
+	void checkVersion(int sender, FileId fileId, int version);
+	void fileOutOfDate(FileId fileId, int versionNumber);
+	void versionDigest(int sender, std::vector<VersionEntry> digest);
+	void updateSummary(int sender, int depth, std::vector<uint32_t> bits);
+	void pushSummaries(bool wait);
+	void summaryLoop();
+	std::vector<int> routeQuery(int sender, int TTL, FileId fileId);
+	std::vector<int> routeInvalidation(int TTL, FileId fileId);
+	std::array<long long, 4> routingStats();
+	std::array<long long, 3> cacheStats();
+	int raiseNewestVersion(FileId fileId, int version);
+	void recordChange(FileId fileId, int version);
+	void invalidateStale(FileId fileId, int newestVersion);
+	void openIndex();
+	size_t replayLog(const std::string &path);
+	void faultIn(FileId fileId);
+	void dropDepartedLeaves();
+	void logChange(FileId fileId, int leafId, int version, bool valid);
+	void logChanges(const std::vector<IndexRecord> &records);
+	void flushLog();
+	void writeSnapshot();
+	void snapshotLoop();
+
+	int id, nSupers, nChildren, startTTL;
+	bool push = false, pull1 = false, pull2 = false;
+	std::unordered_map<int, std::shared_ptr<Client>> neighborClients; // fixed at startup
+	ConnectionPool leafConnections;
+
+	IndexShard indexShards[INDEX_SHARDS];
+	MessageHistory<std::unordered_set<int>> queryHistory;
+	MessageHistory<bool> invalidateHistory;
+	std::unordered_map<FileId, int> versionChanges; // fileId -> newest version, changed since the last digest
+	BloomFilter localSummary;
+	std::unordered_map<int, std::vector<BloomFilter>> neighborSummaries; // neighbor -> files reachable at 0, 1, ... hops past it
+	std::unordered_map<int, std::vector<BloomFilter>> sentSummaries; // neighbor -> levels we last sent it
+	bool summaryDirty = true;
+	QueryCache queryCache;
+	HitRecipients hitRecipients; // guarded by cacheLock
+	std::string indexPath; // snapshot and delta log path prefix, empty unless GNUTELLA_INDEX_DIR is set
+	std::shared_ptr<IndexSnapshot> snapshot; // only read or replaced through std::atomic_load and std::atomic_store
+	int snapshotSlot = 0; // only touched by openIndex and the snapshot timer job
+	std::unordered_set<int> readyLeaves; // children that sent their ready signal
+	std::shared_ptr<std::unordered_set<int>> liveLeaves; // readyLeaves once every child is ready, else null; atomic_load/atomic_store only
+	std::ofstream indexLog;
+	std::vector<IndexRecord> pendingRecords; // changes not yet written to indexLog, in the order they were applied
+	long long loggedChanges = 0; // changes logged since the last snapshot
+	long long forwardedQueries = 0, suppressedQueries = 0;
+	long long forwardedInvalidations = 0, suppressedInvalidations = 0;
+
+	int readyCount = 0;
+	bool canEnd = false;
+	std::mutex countLock;
+	std::mutex historyLock;
+	std::mutex invalidateLock;
+	std::mutex changeLock;
+	std::mutex routingLock;
+	std::mutex cacheLock;
+	std::shared_timed_mutex summaryLock;
+	std::mutex logLock;
+	std::mutex waitLock;
+	std::condition_variable ready;
+};
+
+int runSuperPeer(int argc, char* argv[]) {
+	//Supers are objects so the simulation build can run many of them in one process
+	std::unique_ptr<SuperPeer> node(new SuperPeer());
+	return node->run(argc, argv);
+}
+
+#ifndef GNUTELLA_SIMULATION
 int main(int argc, char* argv[]) {
+	return runSuperPeer(argc, argv);
+}
+#endif
+
+int SuperPeer::run(int argc, char* argv[]) {
 	//Parse args for ID, nChildren, neighbors
 	if (argc < 4) {
 		return -1;
@@ -56,6 +617,8 @@ int main(int argc, char* argv[]) {
 	id = std::stoi(argv[0]);
 	nSupers = std::stoi(argv[1]);
 	nChildren = std::stoi(argv[2]);
+	//Keep a connection to every child on top of the usual pool
+	leafConnections.setCapacity(nChildren + CONNECTION_POOL_CAPACITY);
 	startTTL = std::stoi(argv[3]);
 	int mode = std::stoi(argv[4]);
 	if (mode == 1 || mode == 3) {
@@ -68,236 +631,469 @@ int main(int argc, char* argv[]) {
 		pull2 = true;
 	}
 	//Start server for file registrations, pings, ready signals, queries, queryhits, and end signal
-	rpc::server server(8000 + id);
-	server.bind("ready", &leafReady);
-	server.bind("add", &add);
-	server.bind("query", &query);
-	server.bind("queryHit", &queryHit);
-	server.bind("ping", &ping);
-	server.bind("invalidate", &invalidate);
-	server.bind("end", &end);
-	server.bind("updateVersion", &updateVersion);
-	server.bind("fileOutOfDate", &fileOutOfDate);
-	server.bind("checkVersion", &checkVersion);
+	Server server(8000 + id);
+	Stats::bind(server, "ready", this, &SuperPeer::leafReady);
+	Stats::bind(server, "add", this, &SuperPeer::add);
+	Stats::bind(server, "addBatch", this, &SuperPeer::addBatch);
+	Stats::bind(server, "query", this, &SuperPeer::query);
+	Stats::bind(server, "queryBatch", this, &SuperPeer::queryBatch);
+	Stats::bind(server, "queryHit", this, &SuperPeer::queryHit);
+	Stats::bind(server, "queryHitBatch", this, &SuperPeer::queryHitBatch);
+	Stats::bind(server, "ping", this, &SuperPeer::ping);
+	Stats::bind(server, "invalidate", this, &SuperPeer::invalidate);
+	Stats::bind(server, "end", this, &SuperPeer::end);
+	Stats::bind(server, "updateVersion", this, &SuperPeer::updateVersion);
+	Stats::bind(server, "fileOutOfDate", this, &SuperPeer::fileOutOfDate);
+	Stats::bind(server, "checkVersion", this, &SuperPeer::checkVersion);
+	Stats::bind(server, "versionDigest", this, &SuperPeer::versionDigest);
+	Stats::bind(server, "historyStats", this, &SuperPeer::historyStats);
+	Stats::bind(server, "updateSummary", this, &SuperPeer::updateSummary);
+	Stats::bind(server, "routingStats", this, &SuperPeer::routingStats);
+	Stats::bind(server, "cacheStats", this, &SuperPeer::cacheStats);
+	Stats::bind(server, "connectionStats", this, &SuperPeer::connectionStats);
+	server.bind("stats", &Stats::report);
+	server.bind("trace", &Trace::report);
 	server.bind("stop_server", []() {
-		rpc::this_server().stop();
+		stopServer();
 	});
+	//Load the saved index before taking any calls
+	Log::start("super " + std::to_string(id));
+	openIndex();
 	server.async_run(4);
-	std::cout << "Im a super with ID " << id << std::endl;
-	//Create clients for neighbors once they're online
+	LOG_INFO("Im a super with ID " << id);
+	//Neighbors are listed after the mode, either as IDs or as @file holding the IDs
+	std::vector<int> neighborIds;
 	for (int i = 5; i < argc; i++) {
-		int neighborId = std::stoi(argv[i]);
-		rpc::client *neighborClient = new rpc::client("localhost", 8000 + neighborId);
-		neighborClient->set_timeout(1000);
-		//Ping server until it responds
-		while (true) {
-			try {
-				neighborClient->call("ping");
-				break;
-			}
-			catch (rpc::timeout &t) {
-				//Ping timed out, try restarting client
-				delete neighborClient;
-				neighborClient = new rpc::client("localhost", 8000 + neighborId);
-				neighborClient->set_timeout(1000);
-				t; //Silence warning
+		if (argv[i][0] == '@') {
+			std::ifstream neighborFile(argv[i] + 1);
+			int neighborId;
+			while (neighborFile >> neighborId) {
+				neighborIds.push_back(neighborId);
 			}
 		}
-		neighborClient->clear_timeout();
-		neighborClients.insert({ neighborId, neighborClient });
+		else {
+			neighborIds.push_back(std::stoi(argv[i]));
+		}
+	}
+	//Create clients for neighbors once they're online, all at once
+	for (auto &neighbor : Bootstrap::connectAll(neighborIds)) {
+		neighborClients.insert(neighbor);
 	}
 	//Wait for all children to give ready signal
 	std::unique_lock<std::mutex> unique(waitLock);
-	ready.wait(unique, [] { return readyCount >= nChildren; });
-	std::cout << "----- Children Ready -----" << std::endl;
+	ready.wait(unique, [this] { return readyCount >= nChildren; });
+	LOG_INFO("----- Children Ready -----");
+	if (!indexPath.empty()) {
+		dropDepartedLeaves();
+	}
+	//Make sure neighbors have our index summary before queries start, then keep it up to date
+	pushSummaries(true);
+	runAfter(std::chrono::milliseconds(SUMMARY_PERIOD_MS), [this] { summaryLoop(); });
+	if (!indexPath.empty()) {
+		runAfter(std::chrono::milliseconds(SNAPSHOT_PERIOD_MS), [this] { snapshotLoop(); });
+	}
 	//Send ready signal to system
-	rpc::client sysClient("localhost", 8000);
+	Client sysClient("localhost", 8000);
 	sysClient.call("ready");
 	if (pull2) {
 		while (!canEnd) {
-			std::cout << "Checking versions" << std::endl;
-			for (auto mapIter : fileVersionIndex) {
-				std::string fileName = mapIter.first;
-				auto fileMap = mapIter.second;
-				for (auto fileMapIter : fileMap) {
-					int leafId = fileMapIter.first;
-					int version = fileMapIter.second.second;
-					for (auto client : neighborClients) {
-						client.second->async_call("checkVersion", id, fileName, version);
-					}
+			//Only exchange the versions that changed since the last round
+			changeLock.lock();
+			std::vector<VersionEntry> digest(versionChanges.begin(), versionChanges.end());
+			versionChanges.clear();
+			changeLock.unlock();
+			if (!digest.empty()) {
+				LOG_DEBUG("Sending " << digest.size() << " version changes");
+				for (auto &entry : digest) {
+					invalidateStale(entry.first, entry.second);
+				}
+				for (auto client : neighborClients) {
+					Stats::asyncCall(client.second, "versionDigest", id, digest);
 				}
 			}
 			std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 		}
 	}
 	//Wait for end signal
-	ready.wait(unique, [] { return canEnd && false; });
+	ready.wait(unique, [this] { return canEnd && false; });
 
 	//std::this_thread::sleep_for(std::chrono::milliseconds(5000));
 	//Wait for own server to end gracefully
-	rpc::client selfClient("localhost", 8000 + id);
+	Client selfClient("localhost", 8000 + id);
 	selfClient.call("stop_server");
-	//Free clients
-	for (auto client : neighborClients) {
-		delete client.second;
-	}
-	for (auto client : leafClients) {
-		delete client.second;
-	}
-	std::cout << "dead" << std::endl;
+	LOG_INFO("dead");
+	Log::shutdown();
+	return 0;
+}
+
+void SuperPeer::query(int sender, std::array<int, 2> messageId, int TTL, FileId fileId) {
+	queryBatch(sender, TTL, { QueryEntry(messageId, fileId) });
 }
 
-void query(int sender, std::array<int, 2> messageId, int TTL, std::string fileName) {
+void SuperPeer::queryBatch(int sender, int TTL, std::vector<QueryEntry> queries) {
+	long long arrived = Trace::enabled() ? Trace::now() : 0;
+	//Drop queries we've already seen, remembering the extra sender for the reverse path
+	std::vector<QueryEntry> fresh;
 	historyLock.lock();
-	printlock.lock();
-	std::cout << sender << " wants " << fileName << std::endl;
-	printlock.unlock();
-	std::unordered_set<int> &senders = queryHistory[messageId];
-	if (senders.empty()) {
-		//Add new sender to history
+	for (auto &entry : queries) {
+		bool isNew;
+		std::unordered_set<int> &senders = queryHistory.touch(entry.first, isNew);
 		senders.insert(sender);
-		historyLock.unlock();
-		//Check own index for the file
-		indexLock.lock();
-		const auto indexEntry = fileIndex.find(fileName);
-		if (indexEntry != fileIndex.end()) {
-			//Reply with queryHit
-			printlock.lock();
-			std::cout << "File found! Replying to " << sender << " about " << fileName << " at: ";
-			for (auto entry : indexEntry->second) {
-				std::cout << entry << " ";
-			}
-			std::cout << std::endl;
-			printlock.unlock();
-			//std::cout << "hit" << std::endl;
-			getClient(sender)->async_call("queryHit", id, messageId, startTTL, fileName, indexEntry->second);
+		if (isNew) {
+			fresh.push_back(std::move(entry));
 		}
-		if (TTL - 1 > 0) {
-			//Forward query to neighbors
-			//std::cout << "Forwarding query for " << fileName << " to neighbors: ";
-			for (auto &neighbor : neighborClients) {
-				if (neighbor.first != sender) {
-					//std::cout << " " << neighbor.first;
-					neighbor.second->async_call("query", id, messageId, TTL - 1, fileName);
-				}
+		else if (Trace::enabled()) {
+			Trace::record(TraceEvent(entry.first, TRACE_QUERY, id, sender, TTL, arrived, true, {}));
+		}
+	}
+	historyLock.unlock();
+	if (fresh.empty()) {
+		return;
+	}
+	//Check own index for each file, copying the holders so nothing is sent under a shard lock
+	std::vector<HitEntry> hits;
+	std::unordered_map<int, std::vector<QueryEntry>> forwards;
+	long long routed = 0;
+	std::vector<std::vector<int>> routedTo; // forwarding targets of each fresh query, kept for tracing
+	for (auto &entry : fresh) {
+		FileId fileId = entry.second;
+		routedTo.emplace_back();
+		faultIn(fileId);
+		IndexShard &shard = shardFor(fileId);
+		std::shared_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		const auto indexEntry = shard.fileIndex.find(fileId);
+		bool localHit = indexEntry != shard.fileIndex.end();
+		if (localHit) {
+			hits.push_back(HitEntry(entry.first, fileId, indexEntry->second));
+		}
+		shardLock.unlock();
+		if (TTL - 1 <= 0) {
+			continue;
+		}
+		if (!localHit) {
+			//Answer from recent remote results instead of flooding again
+			std::vector<int> cached;
+			cacheLock.lock();
+			QueryCache::Result result = queryCache.lookup(fileId, cached, TTL);
+			cacheLock.unlock();
+			if (result == QueryCache::HIT) {
+				hits.push_back(HitEntry(entry.first, fileId, cached));
+				continue;
+			}
+			if (result == QueryCache::NEGATIVE) {
+				continue;
 			}
-			//std::cout << std::endl;
 		}
-		indexLock.unlock();
+		routed++;
+		std::vector<int> targets = routeQuery(sender, TTL, fileId);
+		for (int neighborId : targets) {
+			forwards[neighborId].push_back(entry);
+		}
+		routedTo.back() = targets;
+		if (!localHit && !targets.empty()) {
+			cacheLock.lock();
+			queryCache.noteForwarded(fileId, TTL);
+			cacheLock.unlock();
+		}
 	}
-	else {
-		//std::cout << "skipped. messageId: " << messageId[0] << " " << messageId[1] << std::endl;
-		//Add new sender to history
-		senders.insert(sender);
-		historyLock.unlock();
+	if (Trace::enabled()) {
+		for (size_t i = 0; i < fresh.size(); i++) {
+			Trace::record(TraceEvent(fresh[i].first, TRACE_QUERY, id, sender, TTL, arrived, false, routedTo[i]));
+		}
+	}
+	LOG_DEBUG(sender << " wants " << fresh.size() << " files, replying about " << hits.size() << " found here");
+	if (!hits.empty()) {
+		if (neighborClients.find(sender) != neighborClients.end()) {
+			cacheLock.lock();
+			for (auto &hit : hits) {
+				hitRecipients.note(std::get<1>(hit), sender);
+			}
+			cacheLock.unlock();
+		}
+		//Reply with one queryHit batch
+		Stats::asyncCall(getClient(sender), "queryHitBatch", id, startTTL, hits);
+	}
+	//Forward the new queries to each neighbor in one batch, skipping neighbors whose summary rules the file out
+	long long forwarded = 0;
+	for (auto &forward : forwards) {
+		Stats::asyncCall(neighborClients.at(forward.first), "queryBatch", id, TTL - 1, forward.second);
+		forwarded += forward.second.size();
+	}
+	if (TTL - 1 > 0) {
+		routingLock.lock();
+		forwardedQueries += forwarded;
+		suppressedQueries += routed * (neighborClients.size() - neighborClients.count(sender)) - forwarded;
+		routingLock.unlock();
 	}
 }
 
-void queryHit(int sender, std::array<int, 2> messageId, int TTL, std::string fileName, std::vector<int> leaves) {
+void SuperPeer::queryHit(int sender, std::array<int, 2> messageId, int TTL, FileId fileId, std::vector<int> leaves) {
+	queryHitBatch(sender, TTL, { HitEntry(messageId, fileId, leaves) });
+}
+
+void SuperPeer::queryHitBatch(int sender, int TTL, std::vector<HitEntry> hits) {
+	long long arrived = Trace::enabled() ? Trace::now() : 0;
+	if (neighborClients.find(sender) != neighborClients.end()) {
+		//Remember remote results for repeat queries
+		cacheLock.lock();
+		for (auto &hit : hits) {
+			queryCache.store(std::get<1>(hit), std::get<2>(hit));
+		}
+		cacheLock.unlock();
+	}
+	if (TTL - 1 <= 0) {
+		if (Trace::enabled()) {
+			for (auto &hit : hits) {
+				Trace::record(TraceEvent(std::get<0>(hit), TRACE_HIT, id, sender, TTL, arrived, false, {}));
+			}
+		}
+		return;
+	}
+	//Group hits by the neighbors or leaves that sent us each query
+	std::unordered_map<int, std::vector<HitEntry>> routes;
 	historyLock.lock();
-	printlock.lock();
-	std::cout << "Forwarding queryhit for " << fileName<< " from " << sender << " to: ";
-	const auto senders = queryHistory.find(messageId);
-	if (senders != queryHistory.end() && TTL - 1 > 0) {
-		//Forward queryHit to anyone who sent query with messageId
-		for (int querySenderId : senders->second) {
-			if (senders->first[0] != sender) {
-				std::cout << querySenderId << " ";
-				getClient(querySenderId)->async_call("queryHit", id, messageId, TTL - 1, fileName, leaves);
+	for (auto &hit : hits) {
+		const std::array<int, 2> &messageId = std::get<0>(hit);
+		const auto senders = queryHistory.find(messageId);
+		std::vector<int> routedTo;
+		if (senders != nullptr && messageId[0] != sender) {
+			for (int querySenderId : *senders) {
+				routes[querySenderId].push_back(hit);
+				routedTo.push_back(querySenderId);
 			}
-			std::cout << std::endl;
+		}
+		if (Trace::enabled()) {
+			Trace::record(TraceEvent(messageId, TRACE_HIT, id, sender, TTL, arrived, false, routedTo));
 		}
 	}
-	printlock.unlock();
 	historyLock.unlock();
+	//Neighbors on a reverse path cache these holders
+	cacheLock.lock();
+	for (auto &route : routes) {
+		if (neighborClients.find(route.first) != neighborClients.end()) {
+			for (auto &hit : route.second) {
+				hitRecipients.note(std::get<1>(hit), route.first);
+			}
+		}
+	}
+	cacheLock.unlock();
+	//Forward one batch along each reverse path
+	LOG_DEBUG("Forwarding " << hits.size() << " queryhits from " << sender << " along " << routes.size() << " reverse paths");
+	for (auto &route : routes) {
+		Stats::asyncCall(getClient(route.first), "queryHitBatch", id, TTL - 1, route.second);
+	}
 }
 
-void invalidate(std::array<int, 2> messageId, int masterId, int TTL, std::string fileName, int versionNumber) {
-	//std::cout << "Forwarding invalidate for " << fileName << std::endl;
+void SuperPeer::invalidate(std::array<int, 2> messageId, int masterId, int TTL, FileId fileId, int versionNumber) {
 	invalidateLock.lock();
-	if (invalidateHistory.find(messageId) == invalidateHistory.end()) {
-		invalidateHistory.insert(messageId);
+	bool isNew;
+	invalidateHistory.touch(messageId, isNew);
+	if (isNew) {
 		invalidateLock.unlock();
-		// send invalidate to leaves
-		for (auto client : leafClients) {
-			client.second->async_call("invalidate", messageId, masterId, TTL - 1, fileName, versionNumber);
+		//Holders we cached for this file are about to re-download it, and so are the ones neighbors cached from us
+		cacheLock.lock();
+		queryCache.erase(fileId);
+		std::vector<int> cachedAt = hitRecipients.take(fileId);
+		cacheLock.unlock();
+		// send invalidate to the leaves holding a copy
+		std::vector<int> holders;
+		faultIn(fileId);
+		IndexShard &shard = shardFor(fileId);
+		std::shared_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		const auto indexEntry = shard.fileIndex.find(fileId);
+		if (indexEntry != shard.fileIndex.end()) {
+			for (int leafId : indexEntry->second) {
+				if (leafId != masterId) {
+					holders.push_back(leafId);
+				}
+			}
 		}
-		// send invalidate to neighbors
+		shardLock.unlock();
+		for (int leafId : holders) {
+			Stats::asyncCall(getClient(leafId), "invalidate", messageId, masterId, TTL - 1, fileId, versionNumber);
+		}
+		// send invalidate to neighbors whose summaries may hold a copy, and to neighbors caching holders we
+		// sent them whatever the TTL, since they only got those holders by being within the query's reach
+		std::vector<int> targets;
 		if (TTL - 1 > 0) {
-			for (auto client : neighborClients) {
-				client.second->async_call("invalidate", messageId, masterId, TTL - 1, fileName, versionNumber);
+			targets = routeInvalidation(TTL, fileId);
+		}
+		for (int neighborId : cachedAt) {
+			if (std::find(targets.begin(), targets.end(), neighborId) == targets.end()) {
+				targets.push_back(neighborId);
 			}
 		}
+		for (int neighborId : targets) {
+			Stats::asyncCall(neighborClients.at(neighborId), "invalidate", messageId, masterId, TTL - 1, fileId, versionNumber);
+		}
+		routingLock.lock();
+		forwardedInvalidations += holders.size() + targets.size();
+		suppressedInvalidations += std::max<long long>(0, (long long)nChildren - (long long)holders.size());
+		suppressedInvalidations += TTL - 1 > 0 ? neighborClients.size() - targets.size() : 0;
+		routingLock.unlock();
 	}
 	else {
 		invalidateLock.unlock();
 	}
 }
 
-void add(int leafId, std::string fileName, int version) {
-	indexLock.lock();
-	std::cout << "File registered: " << leafId << " has " << fileName << std::endl;
-	std::vector<int> &leaves = fileIndex[fileName];
+void SuperPeer::add(int leafId, std::string fileName, int version) {
+	if (!addBatch(leafId, { { fileName, version } }).empty()) {
+		respondError("File ID collision");
+	}
+}
 
-	fileVersionIndex[fileName][leafId].first = version;
-	fileVersionIndex[fileName][leafId].second = true;
-	if (std::find(leaves.begin(), leaves.end(), leafId) == leaves.end()) {
-		leaves.push_back(leafId);
+std::vector<std::string> SuperPeer::addBatch(int leafId, std::vector<Registration> files) {
+	//Registers a leaf's files in one message, taking each shard lock once for all of its files.
+	//Registration is the only message carrying the file name; names whose ID is already taken are rejected
+	//and returned
+	std::vector<std::vector<size_t>> byShard(INDEX_SHARDS);
+	std::vector<FileId> fileIds(files.size());
+	for (size_t i = 0; i < files.size(); i++) {
+		fileIds[i] = fileIdOf(files[i].first);
+		faultIn(fileIds[i]);
+		byShard[&shardFor(fileIds[i]) - indexShards].push_back(i);
+	}
+	std::vector<std::string> rejected;
+	std::vector<IndexRecord> records;
+	std::vector<FileId> newFiles;
+	std::vector<VersionEntry> changes;
+	records.reserve(files.size());
+	for (int s = 0; s < INDEX_SHARDS; s++) {
+		if (byShard[s].empty()) {
+			continue;
+		}
+		IndexShard &shard = indexShards[s];
+		std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		size_t firstRecord = records.size();
+		for (size_t i : byShard[s]) {
+			FileId fileId = fileIds[i];
+			const std::string &fileName = files[i].first;
+			int version = files[i].second;
+			const auto nameEntry = shard.fileNames.find(fileId);
+			if (nameEntry == shard.fileNames.end()) {
+				shard.fileNames.insert({ fileId, fileName });
+			}
+			else if (nameEntry->second != fileName) {
+				LOG_WARN("File ID collision between " << fileName << " and " << nameEntry->second);
+				rejected.push_back(fileName);
+				continue;
+			}
+			std::vector<int> &leaves = shard.fileIndex[fileId];
+			auto &versions = shard.fileVersionIndex[fileId];
+			if (leaves.empty()) {
+				newFiles.push_back(fileId);
+			}
+			//A leaf is listed in fileIndex exactly when it has a version entry, so no scan of leaves is needed
+			if (versions.find(leafId) == versions.end()) {
+				leaves.push_back(leafId);
+			}
+			versions[leafId] = std::make_pair(version, true);
+			int &newest = shard.newestVersions.insert({ fileId, version }).first->second;
+			newest = std::max(newest, version);
+			records.push_back({ fileId, leafId, version, 1u, 0 });
+			changes.push_back({ fileId, newest });
+		}
+		logChanges(std::vector<IndexRecord>(records.begin() + firstRecord, records.end()));
+	}
+	flushLog();
+	if (!newFiles.empty()) {
+		std::unique_lock<std::shared_timed_mutex> lock(summaryLock);
+		for (FileId fileId : newFiles) {
+			summaryDirty |= localSummary.add(fileId);
+		}
+	}
+	for (const VersionEntry &change : changes) {
+		recordChange(change.first, change.second);
 	}
-	indexLock.unlock();
+	LOG_DEBUG("Files registered: " << leafId << " has " << records.size() << " more");
+	return rejected;
 }
 
-rpc::client* getClient(int clientId) {
+std::shared_ptr<Client> SuperPeer::getClient(int clientId) {
 	//Return a client - neighbor or leaf
-	//std::cout << "Client: " << clientId;
 	const auto neighborIter = neighborClients.find(clientId);
 	if (neighborIter != neighborClients.end()) {
-		//std::cout << "neighbor" << std::endl;
 		return neighborIter->second;
 	}
-	const auto leafIter = leafClients.find(clientId);
-	if (leafIter != leafClients.end()) {
-		//std::cout << "leaf" << std::endl;
-		return leafIter->second;
-	}
-	//If the client doesn't exist yet, we assume its a leaf
-	rpc::client *client = new rpc::client("localhost", 8000 + clientId);
-	leafClients.insert({ clientId, client });
-	//std::cout << "new" << std::endl;
-	return leafClients.find(clientId)->second;
+	//Anyone else is a leaf
+	return leafConnections.get(clientId);
+}
+
+std::array<long long, 5> SuperPeer::connectionStats() {
+	//Returns leaf connection {reuses, new connections, evictions, reconnects, open}
+	return leafConnections.stats();
 }
 
-void leafReady() {
+IndexShard &SuperPeer::shardFor(FileId fileId) {
+	//Each file lives in one shard so registrations only lock out lookups of that shard
+	return indexShards[(fileId ^ (fileId >> 32)) % INDEX_SHARDS];
+}
+
+void SuperPeer::leafReady(int leafId) {
 	countLock.lock();
-	std::cout << "leaf ready" << std::endl;
+	LOG_INFO("leaf ready");
 	readyCount++;
+	readyLeaves.insert(leafId);
+	if (std::atomic_load(&liveLeaves)) {
+		//A leaf that joined after the index was reconciled
+		std::atomic_store(&liveLeaves, std::make_shared<std::unordered_set<int>>(readyLeaves));
+	}
 	countLock.unlock();
 	ready.notify_one();
 }
 
-void end() {
+void SuperPeer::end() {
 	canEnd = true;
 	ready.notify_one();
 }
 
-void ping() {}
+void SuperPeer::ping() {}
 
-void dumpIndex() {
-	std::cout << "Dump:" << std::endl;
-	for (auto tuple : fileIndex) {
-		std::cout << tuple.first << ": ";
-		for (auto IdIter : tuple.second) {
-			std::cout << IdIter << " ";
+void SuperPeer::dumpIndex() {
+	std::ostringstream dump;
+	dump << "Dump:";
+	for (auto &shard : indexShards) {
+		std::shared_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		for (const auto &tuple : shard.fileIndex) {
+			//Files faulted in from a snapshot have no name until a leaf registers them again
+			const auto name = shard.fileNames.find(tuple.first);
+			dump << std::endl;
+			if (name != shard.fileNames.end()) {
+				dump << name->second << ": ";
+			}
+			else {
+				dump << std::hex << tuple.first << std::dec << ": ";
+			}
+			for (auto IdIter : tuple.second) {
+				dump << IdIter << " ";
+			}
 		}
-		std::cout << std::endl;
 	}
+	LOG_INFO(dump.str());
 }
 
-void updateVersion(int leafId, std::string fileName, int version) {
-	indexLock.lock();
-	const auto mapEntry = fileVersionIndex.find(fileName); // iterator, {leafId -> (version,isValid)}
-	if (mapEntry != fileVersionIndex.end()) {
-		// found fileName in fileVersionIndex
+std::array<long long, 4> SuperPeer::historyStats() {
+	//Returns {query entries, query evictions, invalidate entries, invalidate evictions}
+	std::array<long long, 4> stats;
+	historyLock.lock();
+	stats[0] = queryHistory.size();
+	stats[1] = queryHistory.evictions();
+	historyLock.unlock();
+	invalidateLock.lock();
+	stats[2] = invalidateHistory.size();
+	stats[3] = invalidateHistory.evictions();
+	invalidateLock.unlock();
+	return stats;
+}
+
+void SuperPeer::updateVersion(int leafId, FileId fileId, int version) {
+	faultIn(fileId);
+	IndexShard &shard = shardFor(fileId);
+	std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+	const auto mapEntry = shard.fileVersionIndex.find(fileId); // iterator, {leafId -> (version,isValid)}
+	if (mapEntry != shard.fileVersionIndex.end()) {
+		// found fileId in fileVersionIndex
 		const auto pairEntry = (mapEntry->second).find(leafId);
 		if (pairEntry != (mapEntry->second).end()) {
 			// found leafID, update the version and validity
@@ -305,36 +1101,552 @@ void updateVersion(int leafId, std::string fileName, int version) {
 			fileVersion = version;
 			auto &isFileValid = (pairEntry->second).second;
 			isFileValid = true;
+			logChange(fileId, leafId, version, true);
 		}
 	}
-	indexLock.unlock();
+	shardLock.unlock();
+	flushLog();
+	recordChange(fileId, std::max(raiseNewestVersion(fileId, version), version));
 }
 
-void checkVersion(int sender, std::string fileName, int version) {
-	//std::cout << "CHECK VERSION" << std::endl;
-	indexLock.lock();
+void SuperPeer::checkVersion(int sender, FileId fileId, int version) {
+	faultIn(fileId);
+	IndexShard &shard = shardFor(fileId);
+	std::shared_lock<std::shared_timed_mutex> shardLock(shard.lock);
 	int newestVersion = -1;
-	const auto mapEntry = fileVersionIndex.find(fileName); // iterator, {leafId -> (version,isValid)}
-	if (mapEntry != fileVersionIndex.end()) {
-		// found fileName in fileVersionIndex
-		int newestVersion = -1;
+	const auto mapEntry = shard.fileVersionIndex.find(fileId); // iterator, {leafId -> (version,isValid)}
+	if (mapEntry != shard.fileVersionIndex.end()) {
+		// found fileId in fileVersionIndex
 		for (auto const &pairEntry : (mapEntry->second)) {
 			auto &fileVersion = (pairEntry.second).first;
 			if (fileVersion > newestVersion) {
 				newestVersion = fileVersion;
 			}
 		}
-		if (newestVersion > version) {
-			getClient(sender)->async_call("fileOutOfDate", fileName, newestVersion);
+	}
+	shardLock.unlock();
+	if (newestVersion > version) {
+		Stats::asyncCall(getClient(sender), "fileOutOfDate", fileId, newestVersion);
+	}
+}
+
+void SuperPeer::fileOutOfDate(FileId fileId, int versionNumber) {
+	cacheLock.lock();
+	queryCache.erase(fileId);
+	cacheLock.unlock();
+	faultIn(fileId);
+	IndexShard &shard = shardFor(fileId);
+	std::shared_lock<std::shared_timed_mutex> shardLock(shard.lock);
+	const auto indexEntry = shard.fileIndex.find(fileId);
+	if (indexEntry == shard.fileIndex.end()) {
+		return;
+	}
+	std::vector<int> holders = indexEntry->second;
+	shardLock.unlock();
+	for (auto const &leafNodeID : holders) {
+		Stats::asyncCall(getClient(leafNodeID), "invalidate", std::array<int, 2>({ 0, 0 }), -1, startTTL, fileId, versionNumber);
+	}
+}
+
+void SuperPeer::versionDigest(int sender, std::vector<VersionEntry> digest) {
+	//Adopt newer versions from the sender and tell it about any versions newer than the ones it sent
+	std::vector<VersionEntry> newer;
+	for (auto &entry : digest) {
+		int newest = raiseNewestVersion(entry.first, entry.second);
+		if (newest > entry.second) {
+			newer.push_back(VersionEntry(entry.first, newest));
+		}
+		else if (entry.second > newest) {
+			recordChange(entry.first, entry.second);
 		}
 	}
-	indexLock.unlock();
+	if (!newer.empty()) {
+		Stats::asyncCall(getClient(sender), "versionDigest", id, newer);
+	}
 }
 
-void fileOutOfDate(std::string fileName, int versionNumber) {
-	//std::cout << "FILE OUT OF DATE!" << std::endl;
-	const auto &indexEntry = fileIndex.find(fileName);
-	for (auto const &leafNodeID : (indexEntry->second)) {
-		getClient(leafNodeID)->async_call("invalidate", std::array<int, 2>({ 0, 0 }), -1, startTTL, fileName, versionNumber);
+int SuperPeer::raiseNewestVersion(FileId fileId, int version) {
+	//Raises the newest known version of fileId to version, returning the newest version before the call
+	faultIn(fileId);
+	IndexShard &shard = shardFor(fileId);
+	std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+	auto newestEntry = shard.newestVersions.find(fileId);
+	if (newestEntry == shard.newestVersions.end()) {
+		shard.newestVersions.insert({ fileId, version });
+		return -1;
+	}
+	int newest = newestEntry->second;
+	newestEntry->second = std::max(newest, version);
+	return newest;
+}
+
+void SuperPeer::recordChange(FileId fileId, int version) {
+	//Queue a version change for the next pull2 digest round
+	if (!pull2) {
+		return;
+	}
+	changeLock.lock();
+	auto change = versionChanges.find(fileId);
+	if (change == versionChanges.end()) {
+		versionChanges.insert({ fileId, version });
+	}
+	else {
+		change->second = std::max(change->second, version);
+	}
+	changeLock.unlock();
+}
+
+void SuperPeer::invalidateStale(FileId fileId, int newestVersion) {
+	//Tell our own leaves holding an older version of fileId to fetch the newest one
+	cacheLock.lock();
+	queryCache.erase(fileId);
+	cacheLock.unlock();
+	faultIn(fileId);
+	IndexShard &shard = shardFor(fileId);
+	std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+	std::vector<int> stale;
+	const auto mapEntry = shard.fileVersionIndex.find(fileId);
+	if (mapEntry != shard.fileVersionIndex.end()) {
+		for (auto &pairEntry : mapEntry->second) {
+			if (pairEntry.second.first < newestVersion && pairEntry.second.second) {
+				pairEntry.second.second = false;
+				stale.push_back(pairEntry.first);
+				logChange(fileId, pairEntry.first, pairEntry.second.first, false);
+			}
+		}
+	}
+	shardLock.unlock();
+	flushLog();
+	for (int leafNodeID : stale) {
+		Stats::asyncCall(getClient(leafNodeID), "invalidate", std::array<int, 2>({ 0, 0 }), -1, startTTL, fileId, newestVersion);
+	}
+}
+
+void SuperPeer::openIndex() {
+	//Maps the newest snapshot and replays the changes logged since. Only the log is read through, so the
+	//time to start serving depends on recent changes, not on how many files the index holds; snapshot
+	//entries are merged in by faultIn as files get used, and leaves' own registrations win over them
+	std::string directory = Log::env("GNUTELLA_INDEX_DIR");
+	if (directory.empty()) {
+		return;
+	}
+#ifdef _WIN32
+	_mkdir(directory.c_str());
+#else
+	mkdir(directory.c_str(), 0755);
+#endif
+	indexPath = directory + "/super" + std::to_string(id);
+	auto started = std::chrono::steady_clock::now();
+	std::shared_ptr<IndexSnapshot> newest;
+	for (int slot = 0; slot < 2; slot++) {
+		std::shared_ptr<IndexSnapshot> candidate = IndexSnapshot::open(indexPath + ".snapshot." + std::to_string(slot));
+		if (candidate && (!newest || candidate->sequence() > newest->sequence())) {
+			newest = candidate;
+			snapshotSlot = slot;
+		}
 	}
-}
\ No newline at end of file
+	std::atomic_store(&snapshot, newest);
+	if (newest) {
+		localSummary.merge(newest->summary());
+	}
+	size_t replayed = replayLog(indexPath + ".log.old") + replayLog(indexPath + ".log");
+	indexLog.open(indexPath + ".log", std::ios::binary | std::ios::app);
+	loggedChanges = replayed;
+	long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+	LOG_INFO("Index ready in " << elapsed << " ms: " << (newest ? newest->size() : 0) << " snapshot entries, " << replayed << " logged changes");
+}
+
+size_t SuperPeer::replayLog(const std::string &path) {
+	//Applies a delta log in order; a record cut short by a crash ends it
+	std::ifstream log(path, std::ios::binary);
+	IndexRecord record;
+	size_t replayed = 0;
+	while (log.read((char *)&record, sizeof(record))) {
+		faultIn(record.fileId);
+		IndexShard &shard = shardFor(record.fileId);
+		std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		std::vector<int> &leaves = shard.fileIndex[record.fileId];
+		if (std::find(leaves.begin(), leaves.end(), record.leafId) == leaves.end()) {
+			leaves.push_back(record.leafId);
+		}
+		shard.fileVersionIndex[record.fileId][record.leafId] = std::make_pair(int(record.version), record.valid != 0);
+		int &newest = shard.newestVersions.insert({ record.fileId, record.version }).first->second;
+		newest = std::max(newest, int(record.version));
+		shardLock.unlock();
+		localSummary.add(record.fileId);
+		replayed++;
+	}
+	return replayed;
+}
+
+void SuperPeer::faultIn(FileId fileId) {
+	//Merges fileId's snapshot entries into the index the first time anything touches it. Entries already
+	//in the index came from leaves or the log after the snapshot was taken, so they are kept. The
+	//snapshot is loaded atomically, so queries and registrations never wait on each other here
+	if (indexPath.empty()) {
+		return;
+	}
+	std::shared_ptr<IndexSnapshot> mapped = std::atomic_load(&snapshot);
+	if (!mapped) {
+		return;
+	}
+	auto range = mapped->find(fileId);
+	if (range.first == range.second) {
+		return;
+	}
+	IndexShard &shard = shardFor(fileId);
+	std::shared_lock<std::shared_timed_mutex> readLock(shard.lock);
+	bool done = shard.faulted.find(fileId) != shard.faulted.end();
+	readLock.unlock();
+	if (done) {
+		return;
+	}
+	std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+	if (!shard.faulted.insert(fileId).second) {
+		return;
+	}
+	//Loaded under the shard lock, so an entry merged here is either dropped by dropDepartedLeaves or
+	//checked against the leaves it found
+	std::shared_ptr<std::unordered_set<int>> live = std::atomic_load(&liveLeaves);
+	std::vector<int> &leaves = shard.fileIndex[fileId];
+	auto &versions = shard.fileVersionIndex[fileId];
+	int newest = -1;
+	for (auto record = range.first; record != range.second; record++) {
+		if ((!live || live->find(record->leafId) != live->end()) && versions.find(record->leafId) == versions.end()) {
+			versions[record->leafId] = std::make_pair(int(record->version), record->valid != 0);
+			if (std::find(leaves.begin(), leaves.end(), record->leafId) == leaves.end()) {
+				leaves.push_back(record->leafId);
+			}
+		}
+		newest = std::max(newest, int(record->version));
+	}
+	int &known = shard.newestVersions.insert({ fileId, newest }).first->second;
+	known = std::max(known, newest);
+	if (versions.empty()) {
+		shard.fileIndex.erase(fileId);
+		shard.fileVersionIndex.erase(fileId);
+	}
+}
+
+void SuperPeer::dropDepartedLeaves() {
+	//Once every child is ready, the leaves that sent ready are the ones we have. Entries for any other
+	//leaf came from a snapshot or log written before it left, so they are dropped from the index here,
+	//and faultIn and writeSnapshot skip them from now on
+	countLock.lock();
+	std::shared_ptr<std::unordered_set<int>> live = std::make_shared<std::unordered_set<int>>(readyLeaves);
+	std::atomic_store(&liveLeaves, live);
+	countLock.unlock();
+	auto departed = [&live](int leafId) {
+		return live->find(leafId) == live->end();
+	};
+	long long dropped = 0;
+	for (auto &shard : indexShards) {
+		std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		for (auto file = shard.fileVersionIndex.begin(); file != shard.fileVersionIndex.end();) {
+			for (auto leaf = file->second.begin(); leaf != file->second.end();) {
+				if (departed(leaf->first)) {
+					leaf = file->second.erase(leaf);
+					dropped++;
+				}
+				else {
+					leaf++;
+				}
+			}
+			auto indexed = shard.fileIndex.find(file->first);
+			if (indexed != shard.fileIndex.end()) {
+				indexed->second.erase(std::remove_if(indexed->second.begin(), indexed->second.end(), departed), indexed->second.end());
+			}
+			if (file->second.empty()) {
+				if (indexed != shard.fileIndex.end()) {
+					shard.fileIndex.erase(indexed);
+				}
+				file = shard.fileVersionIndex.erase(file);
+			}
+			else {
+				file++;
+			}
+		}
+	}
+	if (dropped > 0) {
+		LOG_INFO("Dropped " << dropped << " index entries for leaves that didn't come back");
+		//Count them as changes so the next snapshot is written without them
+		logLock.lock();
+		loggedChanges += dropped;
+		logLock.unlock();
+	}
+}
+
+void SuperPeer::logChange(FileId fileId, int leafId, int version, bool valid) {
+	//Queues one index change for the delta log
+	if (indexPath.empty()) {
+		return;
+	}
+	logChanges({ { fileId, leafId, version, valid ? 1u : 0u, 0 } });
+}
+
+void SuperPeer::logChanges(const std::vector<IndexRecord> &records) {
+	//Queues index changes for the delta log. Callers still hold the shard lock the changes were made under,
+	//so changes to the same entry queue in the order they were applied; flushLog writes them after the
+	//shard lock is released
+	if (indexPath.empty() || records.empty()) {
+		return;
+	}
+	logLock.lock();
+	pendingRecords.insert(pendingRecords.end(), records.begin(), records.end());
+	logLock.unlock();
+}
+
+void SuperPeer::flushLog() {
+	//Appends every queued change to the delta log with a single write. Whichever caller gets here first
+	//writes the others' changes too
+	if (indexPath.empty()) {
+		return;
+	}
+	logLock.lock();
+	if (!pendingRecords.empty()) {
+		indexLog.write((const char *)pendingRecords.data(), pendingRecords.size() * sizeof(IndexRecord));
+		indexLog.flush();
+		loggedChanges += pendingRecords.size();
+		pendingRecords.clear();
+	}
+	logLock.unlock();
+}
+
+void SuperPeer::writeSnapshot() {
+	//Starts a fresh delta log, then writes the whole index, plus snapshot entries nothing has touched
+	//yet, into the slot not in use. The previous log is only dropped once the new snapshot is complete.
+	//Every change is applied to the index before it is logged, so anything missing from the new
+	//snapshot is in the fresh log
+	std::string logPath = indexPath + ".log";
+	std::string oldLogPath = indexPath + ".log.old";
+	logLock.lock();
+	if (loggedChanges == 0) {
+		logLock.unlock();
+		return;
+	}
+	loggedChanges = 0;
+	if (!std::ifstream(oldLogPath)) {
+		indexLog.close();
+		std::rename(logPath.c_str(), oldLogPath.c_str());
+		indexLog.open(logPath, std::ios::binary | std::ios::app);
+	}
+	logLock.unlock();
+	std::shared_ptr<IndexSnapshot> mapped = std::atomic_load(&snapshot);
+	int slot = 1 - snapshotSlot;
+	std::vector<IndexRecord> records;
+	std::unordered_set<FileId> indexed;
+	for (auto &shard : indexShards) {
+		//Everything in the index now covers its snapshot entries, for the next snapshot too
+		std::unique_lock<std::shared_timed_mutex> shardLock(shard.lock);
+		for (auto &file : shard.fileVersionIndex) {
+			for (auto &leaf : file.second) {
+				records.push_back({ file.first, leaf.first, leaf.second.first, leaf.second.second ? 1u : 0u, 0 });
+			}
+			shard.faulted.insert(file.first);
+			indexed.insert(file.first);
+		}
+	}
+	std::shared_ptr<std::unordered_set<int>> live = std::atomic_load(&liveLeaves);
+	if (mapped) {
+		for (auto record = mapped->begin(); record != mapped->end(); record++) {
+			if (indexed.find(record->fileId) == indexed.end() && (!live || live->find(record->leafId) != live->end())) {
+				records.push_back(*record);
+			}
+		}
+	}
+	std::sort(records.begin(), records.end());
+	std::shared_lock<std::shared_timed_mutex> lock(summaryLock);
+	BloomFilter summary = localSummary;
+	lock.unlock();
+	std::string path = indexPath + ".snapshot." + std::to_string(slot);
+	uint64_t sequence = mapped ? mapped->sequence() + 1 : 1;
+	std::shared_ptr<IndexSnapshot> written;
+	if (IndexSnapshot::write(path, sequence, records, summary)) {
+		written = IndexSnapshot::open(path);
+	}
+	if (!written) {
+		LOG_WARN("Couldn't write index snapshot " << path);
+		logLock.lock();
+		loggedChanges++;
+		logLock.unlock();
+		return;
+	}
+	std::atomic_store(&snapshot, written);
+	snapshotSlot = slot;
+	std::remove(oldLogPath.c_str());
+	LOG_DEBUG("Wrote index snapshot " << sequence << " with " << records.size() << " entries");
+}
+
+void SuperPeer::snapshotLoop() {
+	//Timer job that writes the snapshot and schedules the next one, until the run ends
+	if (canEnd) {
+		return;
+	}
+	writeSnapshot();
+	runAfter(std::chrono::milliseconds(SNAPSHOT_PERIOD_MS), [this] { snapshotLoop(); });
+}
+
+void SuperPeer::updateSummary(int sender, int depth, std::vector<uint32_t> bits) {
+	//Merge the bits a neighbor's attenuated summary gained since its last update, each given as
+	//level * SUMMARY_BITS + bit. Level k holds the files k hops past it; depth is how many levels it knows
+	std::unique_lock<std::shared_timed_mutex> lock(summaryLock);
+	auto &stored = neighborSummaries[sender];
+	if (int(stored.size()) < std::min(depth, SUMMARY_DEPTH)) {
+		stored.resize(std::min(depth, SUMMARY_DEPTH));
+		summaryDirty = true;
+	}
+	for (uint32_t position : bits) {
+		size_t level = position / SUMMARY_BITS;
+		uint32_t bit = position % SUMMARY_BITS;
+		if (level >= stored.size()) {
+			continue;
+		}
+		uint64_t &word = stored[level].words[bit / 64];
+		uint64_t mask = uint64_t(1) << (bit % 64);
+		if ((word & mask) == 0) {
+			word |= mask;
+			summaryDirty = true;
+		}
+	}
+}
+
+void SuperPeer::pushSummaries(bool wait) {
+	//Level 0 is our own index; level k is the union of level k-1 from every other neighbor.
+	//A level is only sent once every other neighbor has reported the level below it. Summaries only
+	//gain bits, so each neighbor only gets the bits set since what it was last sent
+	std::vector<std::tuple<int, int, std::vector<uint32_t>>> updates; // (neighbor, depth, new bits)
+	std::unique_lock<std::shared_timed_mutex> lock(summaryLock);
+	if (!summaryDirty) {
+		return;
+	}
+	summaryDirty = false;
+	std::vector<int> neighbors;
+	for (auto &neighbor : neighborClients) {
+		neighbors.push_back(neighbor.first);
+	}
+	size_t n = neighbors.size();
+	std::vector<std::vector<BloomFilter>> levels(n, std::vector<BloomFilter>(1, localSummary));
+	for (int level = 1; level < SUMMARY_DEPTH; level++) {
+		//Union of every other neighbor's level below, from prefix and suffix unions so a push stays
+		//linear in the number of neighbors
+		std::vector<const BloomFilter *> below(n, nullptr);
+		int unknown = 0;
+		for (size_t i = 0; i < n; i++) {
+			const auto summary = neighborSummaries.find(neighbors[i]);
+			if (summary == neighborSummaries.end() || int(summary->second.size()) < level) {
+				unknown++;
+			}
+			else {
+				below[i] = &summary->second[level - 1];
+			}
+		}
+		if (unknown > 1) {
+			break;
+		}
+		std::vector<BloomFilter> suffix(n + 1);
+		for (size_t i = n; i-- > 0;) {
+			suffix[i] = suffix[i + 1];
+			if (below[i] != nullptr) {
+				suffix[i].merge(*below[i]);
+			}
+		}
+		BloomFilter prefix;
+		for (size_t i = 0; i < n; i++) {
+			//Skip neighbors that already stopped at a lower level, or that aren't the only one missing this level
+			if (int(levels[i].size()) == level && (unknown == 0 || below[i] == nullptr)) {
+				BloomFilter reachable = prefix;
+				reachable.merge(suffix[i + 1]);
+				levels[i].push_back(std::move(reachable));
+			}
+			if (below[i] != nullptr) {
+				prefix.merge(*below[i]);
+			}
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		auto &sent = sentSummaries[neighbors[i]];
+		std::vector<uint32_t> changed;
+		for (size_t level = 0; level < levels[i].size(); level++) {
+			const std::vector<uint64_t> &words = levels[i][level].words;
+			for (size_t index = 0; index < words.size(); index++) {
+				uint64_t added = words[index] & ~(level < sent.size() ? sent[level].words[index] : 0);
+				for (int bit = 0; added != 0; bit++, added >>= 1) {
+					if (added & 1) {
+						changed.push_back(uint32_t(level * SUMMARY_BITS + index * 64 + bit));
+					}
+				}
+			}
+		}
+		if (!changed.empty() || levels[i].size() != sent.size()) {
+			updates.push_back(std::make_tuple(neighbors[i], int(levels[i].size()), std::move(changed)));
+			sent = std::move(levels[i]);
+		}
+	}
+	lock.unlock();
+	for (auto &update : updates) {
+		if (wait) {
+			Stats::call(neighborClients.at(std::get<0>(update)), "updateSummary", id, std::get<1>(update), std::get<2>(update));
+		}
+		else {
+			Stats::asyncCall(neighborClients.at(std::get<0>(update)), "updateSummary", id, std::get<1>(update), std::get<2>(update));
+		}
+	}
+}
+
+void SuperPeer::summaryLoop() {
+	//Timer job that pushes summary changes and schedules the next push, until the run ends
+	if (canEnd) {
+		return;
+	}
+	pushSummaries(false);
+	runAfter(std::chrono::milliseconds(SUMMARY_PERIOD_MS), [this] { summaryLoop(); });
+}
+
+std::vector<int> SuperPeer::routeQuery(int sender, int TTL, FileId fileId) {
+	//Pick the neighbors to forward a query to: every neighbor but the sender whose summary says a copy
+	//may lie within the TTL - 2 hops it can still cover past itself. A false positive at one level never
+	//hides a real holder at another, it only costs an extra forward. Neighbors we know nothing about,
+	//and neighbors whose summary doesn't reach far enough, always get it
+	int reach = TTL - 2;
+	std::vector<int> targets;
+	std::shared_lock<std::shared_timed_mutex> lock(summaryLock);
+	for (auto &neighbor : neighborClients) {
+		if (neighbor.first == sender) {
+			continue;
+		}
+		const auto summary = neighborSummaries.find(neighbor.first);
+		if (summary == neighborSummaries.end() || summary->second.empty() || int(summary->second.size()) - 1 < reach) {
+			targets.push_back(neighbor.first);
+			continue;
+		}
+		for (int level = 0; level <= reach; level++) {
+			if (summary->second[level].mightContain(fileId)) {
+				targets.push_back(neighbor.first);
+				break;
+			}
+		}
+	}
+	return targets;
+}
+
+std::vector<int> SuperPeer::routeInvalidation(int TTL, FileId fileId) {
+	//Invalidations follow the same routes as queries, to every neighbor. Summaries only ever gain files,
+	//so a copy is missed only if it was registered within the last summary period
+	return routeQuery(-1, TTL, fileId);
+}
+
+std::array<long long, 4> SuperPeer::routingStats() {
+	//Returns {queries forwarded, forwards skipped by summaries, invalidations sent, invalidations skipped}
+	routingLock.lock();
+	std::array<long long, 4> stats = { forwardedQueries, suppressedQueries, forwardedInvalidations, suppressedInvalidations };
+	routingLock.unlock();
+	return stats;
+}
+
+std::array<long long, 3> SuperPeer::cacheStats() {
+	//Returns {cache hits, negative hits, misses}
+	cacheLock.lock();
+	std::array<long long, 3> stats = { queryCache.hits, queryCache.negativeHits, queryCache.misses };
+	cacheLock.unlock();
+	return stats;
+}